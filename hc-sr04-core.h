@@ -0,0 +1,69 @@
+/* Interface between the HC-SR04 core module (hc-sr04.ko: sensors, GPIOs,
+ * IRQs, timing, scheduling and the sample stream) and its frontend
+ * modules. Kernel internal.
+ *
+ * A frontend registers a struct hc_sr04_consumer. add() is called for
+ * every sensor present and every sensor added later, remove() before a
+ * sensor goes away or the consumer is unregistered. Both are called with
+ * the core's device list locked, so they must not call back into the core.
+ * sample() is called after every finished ping of any sensor, whoever
+ * asked for it, from process context. sample is only valid if err is 0
+ * or -ERANGE (then flagged out of range).
+ */
+
+#ifndef _HC_SR04_CORE_H
+#define _HC_SR04_CORE_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/time64.h>
+#include <linux/device.h>
+
+#include "hc-sr04.h"
+
+struct hc_sr04;
+
+struct hc_sr04_sample {
+	struct timespec64 timestamp;
+	long long usecs;		/* offset already subtracted */
+	long long echo_delay;		/* trigger to echo start, usecs */
+	unsigned int flags;
+	unsigned int confidence;	/* 0 to 100 */
+	int nr_edges;			/* multi-edge mode only */
+	u32 edges[HC_SR04_MAX_EDGES];	/* see hc-sr04.h */
+};
+
+struct hc_sr04_consumer {
+	struct list_head list;
+	int (*add)(struct hc_sr04 *sensor, struct device *dev);
+	void (*remove)(struct hc_sr04 *sensor, struct device *dev);
+	void (*sample)(struct hc_sr04 *sensor, int err,
+		       const struct hc_sr04_sample *sample);
+};
+
+int hc_sr04_register_consumer(struct hc_sr04_consumer *consumer);
+void hc_sr04_unregister_consumer(struct hc_sr04_consumer *consumer);
+
+/* On-demand ping through the sensor's fair queue, may sleep. */
+int hc_sr04_measure(struct hc_sr04 *sensor, struct hc_sr04_sample *sample);
+
+const char *hc_sr04_name(struct hc_sr04 *sensor);
+
+/* Latest reading and counters of a sensor, taken without pinging it. */
+struct hc_sr04_snapshot {
+	char name[32];
+	u64 pings;			/* finished, with or without echo */
+	int have_last;
+	struct hc_sr04_sample last;	/* last successful ping */
+	u64 timeouts;
+	u64 glitches;
+	u64 stuck_echoes;
+	u64 power_cycles;
+	u64 missed_deadlines;
+	u64 ext_missed;
+	int health;			/* 0 ok, 1 degraded, 2 failed */
+};
+
+int hc_sr04_snapshot(int index, struct hc_sr04_snapshot *snap);
+
+#endif
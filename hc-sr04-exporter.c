@@ -0,0 +1,415 @@
+/* OpenMetrics exporter for the HC-SR04 driver. Serves the last sample and
+ * the counters of all sensors on http://127.0.0.1:<port>/metrics
+ * (default port 9850). Each scrape is a single HC_SR04_NL_CMD_GET_STATS
+ * dump of hc-sr04-netlink.ko, so it doesn't ping any sensor and doesn't
+ * disturb streams.
+ *
+ * Build with make exporter, run as any user:
+ *
+ *	$ ./hc-sr04-exporter 9850
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "hc-sr04.h"
+
+#define DEFAULT_PORT 9850
+#define NL_BUFSIZE 16384
+
+struct sensor {
+	char name[32];
+	int have_last;
+	__s64 timestamp_ns;
+	__u32 usecs;
+	__u32 flags;
+	__u32 confidence;
+	__u32 health;
+	__u64 counters[HC_SR04_NL_ATTR_HEALTH];	/* by attribute */
+};
+
+struct nl_request {
+	struct nlmsghdr nlh;
+	struct genlmsghdr genl;
+	char attrs[64];
+};
+
+static int nl_fd = -1;
+static int family_id;
+static __u32 nl_seq;
+
+static int nl_send(__u16 type, __u16 flags, __u8 cmd,
+		   const struct nlattr *attr)
+{
+	struct nl_request req;
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | flags;
+	req.nlh.nlmsg_seq = ++nl_seq;
+	req.genl.cmd = cmd;
+	req.genl.version = 1;
+	if (attr != NULL) {
+		memcpy(req.attrs, attr, attr->nla_len);
+		req.nlh.nlmsg_len += NLA_ALIGN(attr->nla_len);
+	}
+
+	if (sendto(nl_fd, &req, req.nlh.nlmsg_len, 0,
+		   (struct sockaddr *) &kernel, sizeof(kernel)) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Calls fn for every message answering the last request, until
+ * NLMSG_DONE or the (non-multipart) answer is complete.
+ */
+static int nl_receive(int (*fn)(struct nlmsghdr *nlh, void *data),
+		      void *data)
+{
+	static char buf[NL_BUFSIZE];
+	struct nlmsghdr *nlh;
+	int len, err;
+
+	for (;;) {
+		len = recv(nl_fd, buf, sizeof(buf), 0);
+		if (len < 0)
+			return -errno;
+
+		for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_seq != nl_seq)
+				continue;
+			if (nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				err = ((struct nlmsgerr *)
+					NLMSG_DATA(nlh))->error;
+				if (err != 0 || !(nlh->nlmsg_flags & NLM_F_MULTI))
+					return err;
+				continue;
+			}
+			err = fn(nlh, data);
+			if (err < 0)
+				return err;
+			if (!(nlh->nlmsg_flags & NLM_F_MULTI))
+				return 0;
+		}
+	}
+}
+
+#define for_each_attr(nla, nlh) \
+	for (nla = (struct nlattr *) ((char *) NLMSG_DATA(nlh) + GENL_HDRLEN), \
+	     rem = (nlh)->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN); \
+	     rem >= (int) sizeof(*nla) && nla->nla_len >= sizeof(*nla) && \
+	     nla->nla_len <= rem; \
+	     rem -= NLA_ALIGN(nla->nla_len), \
+	     nla = (struct nlattr *) ((char *) nla + NLA_ALIGN(nla->nla_len)))
+
+#define nla_data(nla) ((void *) ((char *) (nla) + NLA_HDRLEN))
+
+static int parse_family(struct nlmsghdr *nlh, void *data)
+{
+	struct nlattr *nla;
+	int rem;
+
+	for_each_attr(nla, nlh)
+		if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+			*(int *) data = *(__u16 *) nla_data(nla);
+	return 0;
+}
+
+static int resolve_family(void)
+{
+	struct {
+		struct nlattr nla;
+		char name[sizeof(HC_SR04_NL_FAMILY)];
+	} attr;
+	int id = 0, err;
+
+	attr.nla.nla_type = CTRL_ATTR_FAMILY_NAME;
+	attr.nla.nla_len = NLA_HDRLEN + sizeof(HC_SR04_NL_FAMILY);
+	memcpy(attr.name, HC_SR04_NL_FAMILY, sizeof(HC_SR04_NL_FAMILY));
+
+	err = nl_send(GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, &attr.nla);
+	if (err < 0)
+		return err;
+	err = nl_receive(parse_family, &id);
+	if (err < 0)
+		return err;
+	return id > 0 ? id : -ENOENT;
+}
+
+struct sensor_list {
+	struct sensor *sensors;
+	int n;
+	int size;
+};
+
+static int parse_sensor(struct nlmsghdr *nlh, void *data)
+{
+	struct sensor_list *list = data;
+	struct sensor *s;
+	struct nlattr *nla;
+	int rem, type;
+
+	if (list->n == list->size) {
+		int size = list->size ? list->size * 2 : 16;
+
+		s = realloc(list->sensors, size * sizeof(*s));
+		if (s == NULL)
+			return -ENOMEM;
+		list->sensors = s;
+		list->size = size;
+	}
+	s = &list->sensors[list->n++];
+	memset(s, 0, sizeof(*s));
+
+	for_each_attr(nla, nlh) {
+		type = nla->nla_type & NLA_TYPE_MASK;
+		switch (type) {
+		case HC_SR04_NL_ATTR_SENSOR:
+			snprintf(s->name, sizeof(s->name), "%.*s",
+				 (int) (nla->nla_len - NLA_HDRLEN),
+				 (char *) nla_data(nla));
+			break;
+		case HC_SR04_NL_ATTR_TIMESTAMP:
+			memcpy(&s->timestamp_ns, nla_data(nla), 8);
+			s->have_last = 1;
+			break;
+		case HC_SR04_NL_ATTR_USECS:
+			s->usecs = *(__u32 *) nla_data(nla);
+			break;
+		case HC_SR04_NL_ATTR_FLAGS:
+			s->flags = *(__u32 *) nla_data(nla);
+			break;
+		case HC_SR04_NL_ATTR_CONFIDENCE:
+			s->confidence = *(__u32 *) nla_data(nla);
+			break;
+		case HC_SR04_NL_ATTR_HEALTH:
+			s->health = *(__u32 *) nla_data(nla);
+			break;
+		case HC_SR04_NL_ATTR_PINGS ... HC_SR04_NL_ATTR_EXT_MISSED:
+			memcpy(&s->counters[type], nla_data(nla), 8);
+			break;
+		}
+	}
+	return 0;
+}
+
+static int read_sensors(struct sensor_list *list)
+{
+	int err;
+
+	if (family_id <= 0) {
+		family_id = resolve_family();
+		if (family_id < 0)
+			return family_id;
+	}
+
+	list->n = 0;
+	err = nl_send(family_id, NLM_F_DUMP, HC_SR04_NL_CMD_GET_STATS, NULL);
+	if (err == 0)
+		err = nl_receive(parse_sensor, list);
+	if (err < 0)
+		family_id = 0;	/* module reloaded? resolve again */
+	return err;
+}
+
+static const struct {
+	int attr;
+	const char *name;
+	const char *help;
+} counters[] = {
+	{ HC_SR04_NL_ATTR_PINGS, "hc_sr04_pings",
+	  "Finished pings, with or without echo" },
+	{ HC_SR04_NL_ATTR_TIMEOUTS, "hc_sr04_timeouts",
+	  "Pings without echo" },
+	{ HC_SR04_NL_ATTR_GLITCHES, "hc_sr04_glitches",
+	  "Echo pulses dropped as noise" },
+	{ HC_SR04_NL_ATTR_STUCK_ECHOES, "hc_sr04_stuck_echoes",
+	  "Echo line found stuck high" },
+	{ HC_SR04_NL_ATTR_POWER_CYCLES, "hc_sr04_power_cycles",
+	  "Sensor power cycled to free a stuck echo line" },
+	{ HC_SR04_NL_ATTR_MISSED_DEADLINES, "hc_sr04_missed_deadlines",
+	  "Stream pings later than the sensor's rate allows" },
+	{ HC_SR04_NL_ATTR_EXT_MISSED, "hc_sr04_ext_missed",
+	  "External trigger edges ignored" },
+};
+
+static void write_metrics(FILE *f, const struct sensor_list *list)
+{
+	const struct sensor *s;
+	unsigned int c;
+	int i;
+
+	fprintf(f, "# TYPE hc_sr04_echo_seconds gauge\n"
+		   "# UNIT hc_sr04_echo_seconds seconds\n"
+		   "# HELP hc_sr04_echo_seconds Echo length of the last successful ping\n");
+	for (i = 0, s = list->sensors; i < list->n; i++, s++)
+		if (s->have_last)
+			fprintf(f, "hc_sr04_echo_seconds{sensor=\"%s\"} %u.%06u\n",
+				s->name, s->usecs / 1000000,
+				s->usecs % 1000000);
+
+	fprintf(f, "# TYPE hc_sr04_last_sample_timestamp_seconds gauge\n"
+		   "# UNIT hc_sr04_last_sample_timestamp_seconds seconds\n"
+		   "# HELP hc_sr04_last_sample_timestamp_seconds When the last successful ping was taken\n");
+	for (i = 0, s = list->sensors; i < list->n; i++, s++)
+		if (s->have_last)
+			fprintf(f, "hc_sr04_last_sample_timestamp_seconds{sensor=\"%s\"} %lld.%09lld\n",
+				s->name,
+				(long long) (s->timestamp_ns / 1000000000),
+				(long long) (s->timestamp_ns % 1000000000));
+
+	fprintf(f, "# TYPE hc_sr04_last_sample_flags gauge\n"
+		   "# HELP hc_sr04_last_sample_flags Flags of the last successful ping, see hc-sr04.h\n");
+	for (i = 0, s = list->sensors; i < list->n; i++, s++)
+		if (s->have_last)
+			fprintf(f, "hc_sr04_last_sample_flags{sensor=\"%s\"} %u\n",
+				s->name, s->flags);
+
+	fprintf(f, "# TYPE hc_sr04_last_sample_confidence gauge\n"
+		   "# HELP hc_sr04_last_sample_confidence Confidence of the last successful ping, 0 to 100\n");
+	for (i = 0, s = list->sensors; i < list->n; i++, s++)
+		if (s->have_last)
+			fprintf(f, "hc_sr04_last_sample_confidence{sensor=\"%s\"} %u\n",
+				s->name, s->confidence);
+
+	fprintf(f, "# TYPE hc_sr04_health gauge\n"
+		   "# HELP hc_sr04_health 0 ok, 1 degraded, 2 failed\n");
+	for (i = 0, s = list->sensors; i < list->n; i++, s++)
+		fprintf(f, "hc_sr04_health{sensor=\"%s\"} %u\n",
+			s->name, s->health);
+
+	for (c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+		fprintf(f, "# TYPE %s counter\n# HELP %s %s\n",
+			counters[c].name, counters[c].name, counters[c].help);
+		for (i = 0, s = list->sensors; i < list->n; i++, s++)
+			fprintf(f, "%s_total{sensor=\"%s\"} %llu\n",
+				counters[c].name, s->name,
+				(unsigned long long) s->counters[counters[c].attr]);
+	}
+
+	fprintf(f, "# EOF\n");
+}
+
+static void reply(int fd, const char *status, const char *type,
+		  const char *body, size_t len)
+{
+	char head[256];
+	int n;
+
+	n = snprintf(head, sizeof(head),
+		     "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+		     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		     status, type, len);
+	if (write(fd, head, n) == n && len > 0)
+		if (write(fd, body, len) < 0)
+			perror("write");
+}
+
+static void serve(int fd, struct sensor_list *list)
+{
+	static const char not_found[] = "Try /metrics\n";
+	char req[1024];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+	int n, err;
+
+	n = read(fd, req, sizeof(req) - 1);
+	if (n <= 0)
+		return;
+	req[n] = '\0';
+
+	if (strncmp(req, "GET /metrics", 12) != 0 ||
+	    (req[12] != ' ' && req[12] != '?')) {
+		reply(fd, "404 Not Found", "text/plain", not_found,
+		      sizeof(not_found) - 1);
+		return;
+	}
+
+	err = read_sensors(list);
+	if (err < 0) {
+		fprintf(stderr, "hc-sr04-exporter: reading sensors failed: %s "
+			"(is hc-sr04-netlink.ko loaded?)\n", strerror(-err));
+		reply(fd, "503 Service Unavailable", "text/plain", NULL, 0);
+		return;
+	}
+
+	f = open_memstream(&body, &len);
+	if (f == NULL) {
+		reply(fd, "500 Internal Server Error", "text/plain", NULL, 0);
+		return;
+	}
+	write_metrics(f, list);
+	fclose(f);
+
+	reply(fd, "200 OK",
+	      "application/openmetrics-text; version=1.0.0; charset=utf-8",
+	      body, len);
+	free(body);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	struct sockaddr_nl local = { .nl_family = AF_NETLINK };
+	struct timeval timeout = { .tv_sec = 2 };
+	struct sensor_list list = { 0 };
+	int port = DEFAULT_PORT;
+	int listen_fd, fd, on = 1;
+
+	if (argc > 2 || (argc == 2 && (port = atoi(argv[1])) <= 0)) {
+		fprintf(stderr, "usage: %s [port]\n", argv[0]);
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (nl_fd < 0 ||
+	    bind(nl_fd, (struct sockaddr *) &local, sizeof(local)) < 0 ||
+	    setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO,
+		       &timeout, sizeof(timeout)) < 0) {
+		perror("netlink socket");
+		return 1;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (listen_fd < 0 ||
+	    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR,
+		       &on, sizeof(on)) < 0 ||
+	    bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 8) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+			   &timeout, sizeof(timeout));
+		serve(fd, &list);
+		close(fd);
+	}
+}
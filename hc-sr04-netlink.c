@@ -0,0 +1,173 @@
+/* Generic netlink frontend of the HC-SR04 driver: every finished ping of
+ * every sensor is multicast to the HC_SR04_NL_GROUP group of the
+ * HC_SR04_NL_FAMILY family (see hc-sr04.h), whoever triggered it. One
+ * socket thus follows all sensors without pinging them itself. A
+ * HC_SR04_NL_CMD_GET_STATS dump reads the last sample and the counters of
+ * all sensors at once (used by hc-sr04-exporter). Load after hc-sr04.ko.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <net/genetlink.h>
+
+#include "hc-sr04-core.h"
+
+static const struct genl_multicast_group hc_sr04_nl_groups[] = {
+	{ .name = HC_SR04_NL_GROUP },
+};
+
+static int netlink_dump_stats(struct sk_buff *skb,
+			      struct netlink_callback *cb);
+
+static const struct genl_ops hc_sr04_nl_ops[] = {
+	{
+		.cmd = HC_SR04_NL_CMD_GET_STATS,
+		.validate = GENL_DONT_VALIDATE_STRICT |
+			    GENL_DONT_VALIDATE_DUMP,
+		.dumpit = netlink_dump_stats,
+	},
+};
+
+static struct genl_family hc_sr04_nl_family = {
+	.name = HC_SR04_NL_FAMILY,
+	.version = 1,
+	.maxattr = HC_SR04_NL_ATTR_MAX,
+	.module = THIS_MODULE,
+	.ops = hc_sr04_nl_ops,
+	.n_ops = ARRAY_SIZE(hc_sr04_nl_ops),
+	.mcgrps = hc_sr04_nl_groups,
+	.n_mcgrps = ARRAY_SIZE(hc_sr04_nl_groups),
+};
+
+static int put_last_sample(struct sk_buff *skb,
+			   const struct hc_sr04_sample *sample)
+{
+	if (nla_put_s64(skb, HC_SR04_NL_ATTR_TIMESTAMP,
+			timespec64_to_ns(&sample->timestamp),
+			HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u32(skb, HC_SR04_NL_ATTR_USECS, sample->usecs) ||
+	    nla_put_u32(skb, HC_SR04_NL_ATTR_FLAGS, sample->flags) ||
+	    nla_put_u32(skb, HC_SR04_NL_ATTR_CONFIDENCE, sample->confidence))
+		return -EMSGSIZE;
+	if (sample->nr_edges > 0 &&
+	    nla_put(skb, HC_SR04_NL_ATTR_EDGES,
+		    sample->nr_edges * sizeof(sample->edges[0]), sample->edges))
+		return -EMSGSIZE;
+	return 0;
+}
+
+static int put_snapshot(struct sk_buff *skb,
+			const struct hc_sr04_snapshot *snap)
+{
+	if (nla_put_string(skb, HC_SR04_NL_ATTR_SENSOR, snap->name) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_PINGS, snap->pings,
+			      HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_TIMEOUTS, snap->timeouts,
+			      HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_GLITCHES, snap->glitches,
+			      HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_STUCK_ECHOES,
+			      snap->stuck_echoes, HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_POWER_CYCLES,
+			      snap->power_cycles, HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_MISSED_DEADLINES,
+			      snap->missed_deadlines, HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u64_64bit(skb, HC_SR04_NL_ATTR_EXT_MISSED,
+			      snap->ext_missed, HC_SR04_NL_ATTR_PAD) ||
+	    nla_put_u32(skb, HC_SR04_NL_ATTR_HEALTH, snap->health))
+		return -EMSGSIZE;
+	if (snap->have_last)
+		return put_last_sample(skb, &snap->last);
+	return 0;
+}
+
+/* cb->args[0] is the index of the next sensor. Sensors added or removed
+ * during a dump may be skipped or reported twice.
+ */
+static int netlink_dump_stats(struct sk_buff *skb,
+			      struct netlink_callback *cb)
+{
+	struct hc_sr04_snapshot snap;
+	void *hdr;
+	int i;
+
+	for (i = cb->args[0]; hc_sr04_snapshot(i, &snap) == 0; i++) {
+		hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid,
+				  cb->nlh->nlmsg_seq, &hc_sr04_nl_family,
+				  NLM_F_MULTI, HC_SR04_NL_CMD_GET_STATS);
+		if (hdr == NULL)
+			break;
+		if (put_snapshot(skb, &snap) < 0) {
+			genlmsg_cancel(skb, hdr);
+			break;
+		}
+		genlmsg_end(skb, hdr);
+	}
+	cb->args[0] = i;
+
+	return skb->len;
+}
+
+static void netlink_sample(struct hc_sr04 *sensor, int err,
+			   const struct hc_sr04_sample *sample)
+{
+	struct sk_buff *skb;
+	void *hdr;
+
+	if (!genl_has_listeners(&hc_sr04_nl_family, &init_net, 0))
+		return;
+
+	skb = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (skb == NULL)
+		return;
+
+	hdr = genlmsg_put(skb, 0, 0, &hc_sr04_nl_family, 0,
+			  HC_SR04_NL_CMD_SAMPLE);
+	if (hdr == NULL)
+		goto out_free;
+
+	if (nla_put_string(skb, HC_SR04_NL_ATTR_SENSOR,
+			   hc_sr04_name(sensor)) ||
+	    nla_put_s32(skb, HC_SR04_NL_ATTR_STATUS, err))
+		goto out_free;
+	if ((err == 0 || err == -ERANGE) && put_last_sample(skb, sample) < 0)
+		goto out_free;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&hc_sr04_nl_family, skb, 0, 0, GFP_KERNEL);
+	return;
+
+out_free:
+	nlmsg_free(skb);
+}
+
+static struct hc_sr04_consumer netlink_consumer = {
+	.sample = netlink_sample,
+};
+
+static int __init init_hc_sr04_netlink(void)
+{
+	int err;
+
+	err = genl_register_family(&hc_sr04_nl_family);
+	if (err < 0)
+		return err;
+
+	err = hc_sr04_register_consumer(&netlink_consumer);
+	if (err < 0)
+		genl_unregister_family(&hc_sr04_nl_family);
+	return err;
+}
+
+static void exit_hc_sr04_netlink(void)
+{
+	hc_sr04_unregister_consumer(&netlink_consumer);
+	genl_unregister_family(&hc_sr04_nl_family);
+}
+
+module_init(init_hc_sr04_netlink);
+module_exit(exit_hc_sr04_netlink);
+
+MODULE_AUTHOR("Johannes Thoma");
+MODULE_DESCRIPTION("Generic netlink sample stream of HC-SR04 distance sensors");
+MODULE_LICENSE("GPL");
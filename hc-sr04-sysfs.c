@@ -0,0 +1,96 @@
+/* sysfs frontend of the HC-SR04 driver: adds the files measure and
+ * sample to every sensor. Reading them pings the sensor (see hc-sr04.c).
+ * Load after hc-sr04.ko.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+
+#include "hc-sr04-core.h"
+
+static ssize_t sysfs_do_measurement(struct device *dev,
+				    struct device_attribute *attr,
+				    char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_sample sample;
+	int status;
+
+	status = hc_sr04_measure(sensor, &sample);
+
+	if (status < 0)
+		return status;
+
+	return sprintf(buf, "%lld\n", sample.usecs);
+}
+
+DEVICE_ATTR(measure, 0444, sysfs_do_measurement, NULL);
+
+static ssize_t sysfs_do_sample(struct device *dev,
+			       struct device_attribute *attr,
+			       char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_sample sample;
+	int status, i, len;
+
+	status = hc_sr04_measure(sensor, &sample);
+
+	if (status < 0)
+		return status;
+
+	len = sprintf(buf, "%lld 0x%x", sample.usecs, sample.flags);
+	for (i = 0; i < sample.nr_edges; i++)
+		len += sprintf(buf + len, " %c%u",
+			       sample.edges[i] & HC_SR04_EDGE_RISING ? '+' : '-',
+			       sample.edges[i] & HC_SR04_EDGE_USECS);
+	len += sprintf(buf + len, "\n");
+
+	return len;
+}
+
+DEVICE_ATTR(sample, 0444, sysfs_do_sample, NULL);
+
+static struct attribute *measure_attrs[] = {
+	&dev_attr_measure.attr,
+	&dev_attr_sample.attr,
+	NULL,
+};
+
+static const struct attribute_group measure_group = {
+	.attrs = measure_attrs
+};
+
+static int sysfs_add(struct hc_sr04 *sensor, struct device *dev)
+{
+	return sysfs_create_group(&dev->kobj, &measure_group);
+}
+
+static void sysfs_remove(struct hc_sr04 *sensor, struct device *dev)
+{
+	sysfs_remove_group(&dev->kobj, &measure_group);
+}
+
+static struct hc_sr04_consumer sysfs_consumer = {
+	.add = sysfs_add,
+	.remove = sysfs_remove,
+};
+
+static int __init init_hc_sr04_sysfs(void)
+{
+	return hc_sr04_register_consumer(&sysfs_consumer);
+}
+
+static void exit_hc_sr04_sysfs(void)
+{
+	hc_sr04_unregister_consumer(&sysfs_consumer);
+}
+
+module_init(init_hc_sr04_sysfs);
+module_exit(exit_hc_sr04_sysfs);
+
+MODULE_AUTHOR("Johannes Thoma");
+MODULE_DESCRIPTION("sysfs measure and sample files for HC-SR04 distance sensors");
+MODULE_LICENSE("GPL");
@@ -9,15 +9,151 @@
  *	# echo 23 24 1000 > /sys/class/distance-sensor/configure
  *
  * (23 is the trigger GPIO, 24 is the echo GPIO and 1000 is a timeout in
- *  milliseconds)
+ *  milliseconds). An optional fourth number is a GPIO switching the
+ *  sensor's power, active high, used to power cycle a sensor whose echo
+ *  line got stuck high.
  *
- * Then a directory appears with a file measure in it. To measure, do a
+ * Then a directory appears with a file measure in it (with hc-sr04-sysfs.ko
+ * loaded, see below). To measure, do a
  *
  *	# cat /sys/class/distance-sensor/distance_23_24/measure
  *
  * You'll receive the length of the echo signal in usecs. To convert (roughly)
  * to centimeters multiply by 17150 and divide by 1e6.
  *
+ * Reading sample instead of measure also returns a hex flags word:
+ * 0x1 means another sensor fired while this one waited for its echo
+ * (crosstalk), 0x2 means the echo looks like a late reflection of this
+ * sensor's previous ping (ghost).
+ *
+ * With 1 written to multi_edge, a ping listens for the whole echo window
+ * (40ms) and sample also lists every edge on the echo line, as +usecs
+ * (rising) or -usecs (falling) after the trigger, up to 16 of them. The
+ * length reported is still that of the first echo.
+ *
+ * Writing a GPIO number to ext_trigger makes every rising edge on that
+ * GPIO ping the sensor, with the trigger pulse fired from the edge's
+ * interrupt (e.g. to sync with camera frames). Several sensors may share
+ * one GPIO. Results go to the streaming files of the character device,
+ * other pings fail with EBUSY. Edges arriving while the sensor is still
+ * busy or within ping_gap are counted in ext_missed. -1 switches it off.
+ * Not supported on trigger or echo GPIOs that can sleep.
+ *
+ * Writing a name to group puts the sensor into that group, an empty
+ * string takes it out. Each group shows up as group_<name> in the class,
+ * its file nearest reads the echo length, sensor and timestamp (ns) of
+ * the nearest obstacle any member currently sees, or none, and can be
+ * poll()ed for changes. Timeouts count as nothing in range, flagged
+ * samples are ignored.
+ *
+ * JSN-SR04T and US-100 sensors on a UART (serdev, from device tree) are
+ * supported too, see hc_sr04_of_match. They are named after the serdev
+ * device and report the distance in mm, which is converted to an echo
+ * length so they work like the GPIO sensors. They stream independently
+ * of the scheduler thread.
+ *
+ * Idle sensors are runtime suspended (echo edges ignored, power GPIO
+ * off) 2s after their last ping and resumed by the next one. Pings in
+ * flight at system suspend fail with EAGAIN.
+ *
+ * The driver is split into this core module, hc-sr04.ko, and frontends
+ * that only see finished samples (hc-sr04-core.h): hc-sr04-sysfs.ko adds
+ * measure and sample, hc-sr04-netlink.ko multicasts every sample of every
+ * sensor on the generic netlink family hc_sr04 (see hc-sr04.h). Load the
+ * core first, then the frontends needed. The character device and all
+ * other files below are part of the core.
+ *
+ * offset (usecs) is subtracted from every echo length. Writing the
+ * distance (mm) of a flat target to calibrate pings the sensor 32 times
+ * and corrects offset so the median matches. echo_delay reads the time
+ * from the trigger to the start of the last echo.
+ *
+ * Every sample gets a confidence from 0 to 100 (confidence shows that of
+ * the last one, netlink sends it with each sample). It drops with
+ * glitches, a delayed trigger pulse, an unusual trigger to echo delay,
+ * an echo off the recent trend and crosstalk or ghost flags.
+ *
+ * Writing a latency in usecs to cpu_latency keeps the CPUs out of idle
+ * states slower to leave than that while a ping of the sensor is in
+ * flight (all the time with an external trigger), -1 (the default)
+ * allows any.
+ *
+ * Writing "min max" (mm) to range sets a region of interest, "0 0" (the
+ * default) removes it. Samples outside fail with ERANGE and are flagged
+ * HC_SR04_SAMPLE_OUT_OF_RANGE. They are not kept in history, rollups or
+ * as the last sample (echo_delay, confidence, netlink stats). Once the
+ * echo is longer than max the read returns right away instead of
+ * waiting for its end, the next ping still waits for it.
+ *
+ * Sample timestamps (character device, history, rollups, netlink) are
+ * taken in the clock written to clock: realtime (the default),
+ * monotonic, boottime, tai or raw (CLOCK_MONOTONIC_RAW), read in the
+ * echo interrupt together with the edge. Switching it clears history
+ * and rollups.
+ *
+ * Pings are at least ping_gap usecs (default 60000) apart. Writing 1 to
+ * autotune shortens the gap step by step until ghosts show up and keeps
+ * the fastest clean one (shown when reading autotune). While autotuned,
+ * the gap backs off when ghosts appear and returns to the tuned value when
+ * they are gone. Writing ping_gap or 0 to autotune ends that.
+ *
+ * health reads ok, degraded (timeouts or a noisy echo line) or failed. A
+ * sensor fails after 3 timeouts in a row; reads then return EAGAIN
+ * without pinging until a retry is due. The retry interval starts at
+ * 100ms and doubles up to 60s, the first echo makes the sensor ok again.
+ * health can be poll()ed for changes. timeouts and no_echo_starts count
+ * all timeouts and those where the echo line never went high.
+ *
+ * An echo line still high 250ms after the last ping is considered stuck
+ * (counted in stuck_echoes). With a power GPIO the sensor is switched off
+ * for 100ms and the ping continues (counted in power_cycles), else the
+ * read fails with EIO.
+ *
+ * Reading burst pings the sensor burst_count times (write 1 to 32 to
+ * burst to set it, default 5) at ping_gap and returns min, median, mean
+ * and standard deviation of the echo lengths together with the number of
+ * samples used. Samples that timed out or are flagged are left out.
+ *
+ * Every sensor also has a character device /dev/distance_23_24 (see
+ * hc-sr04.h) for asynchronous use: the HC_SR04_IOC_ARM ioctl starts a
+ * ping and returns its sequence number right away, read() collects
+ * struct hc_sr04_record results and poll() tells when one is ready. That
+ * way one thread can keep pings on many sensors in flight.
+ * HC_SR04_IOC_STREAM makes the driver ping the sensor continuously (at
+ * ping_gap) and queue every result for that file, flagged
+ * HC_SR04_SAMPLE_STREAM. With
+ * HC_SR04_IOC_SET_WATERMARK readers are only woken up once a given number
+ * of results is queued or the oldest one reaches a given age.
+ *
+ * Streams of all sensors are pinged by one scheduler thread, one sensor
+ * at a time. A sensor with a rate (in Hz) gets its pings earliest
+ * deadline first, late pings are counted in missed_deadlines. Sensors
+ * with rate 0 (the default) share the remaining airtime, by priority.
+ *
+ * Writing "min max tolerance" to adaptive_rate lets a streaming sensor
+ * halve its rate (down to min Hz) whenever 4 readings in a row stay within
+ * tolerance usecs of each other and go back to max Hz on the first reading
+ * that doesn't. This replaces rate, writing 0 switches it off.
+ *
+ * On-demand pings (measure, sample and armed pings) are queued fairly:
+ * every open file of the character device and every user reading sysfs
+ * gets its turn round robin. client_rate limits each of them and
+ * ondemand_cap all of them together (pings per second, 0: no limit).
+ *
+ * Writing a size in bytes to history_size keeps a history of all pings
+ * of the sensor in kernel memory, delta encoded at about 4 bytes per
+ * sample. The binary history file returns it decoded as struct
+ * hc_sr04_record, oldest first, seq counting from the first sample ever
+ * stored. Writing history_size clears the history, 0 switches it off.
+ *
+ * The binary rollups file returns min/max/mean echo lengths per second
+ * and per minute of the last 60 seconds and minutes that saw pings, as
+ * struct hc_sr04_rollup, in one read.
+ *
+ * Echo pulses shorter than min_pulse_width usecs (default 10) are treated
+ * as noise on the echo line: they are dropped, counted in glitches and the
+ * measurement continues with the next rising edge.
+ *
  * To deconfigure the device, do a
  *
  *	# echo -23 24 > /sys/class/distance-sensor/configure
@@ -43,24 +179,448 @@
 #include <linux/gpio.h>
 #include <linux/delay.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/ctype.h>
+#include <linux/completion.h>
+#include <linux/serdev.h>
+#include <linux/of.h>
+#include <linux/of_device.h>
+#include <linux/pm_runtime.h>
+#include <linux/freezer.h>
+#include <linux/rwsem.h>
+#include <linux/pm_qos.h>
+
+#include "hc-sr04.h"
+#include "hc-sr04-core.h"
+
+enum hc_sr04_health {
+	HEALTH_OK,
+	HEALTH_DEGRADED,	/* timeouts or noisy echo line */
+	HEALTH_FAILED,		/* quarantined, only retried with backoff */
+};
+
+static const char * const health_names[] = {
+	[HEALTH_OK] = "ok",
+	[HEALTH_DEGRADED] = "degraded",
+	[HEALTH_FAILED] = "failed",
+};
+
+/* Clock of the sample timestamps. Timing itself always uses
+ * CLOCK_REALTIME.
+ */
+enum hc_sr04_stamp {
+	STAMP_REALTIME,
+	STAMP_MONOTONIC,
+	STAMP_BOOTTIME,
+	STAMP_TAI,
+	STAMP_RAW,
+};
+
+static const char * const stamp_names[] = {
+	[STAMP_REALTIME] = "realtime",
+	[STAMP_MONOTONIC] = "monotonic",
+	[STAMP_BOOTTIME] = "boottime",
+	[STAMP_TAI] = "tai",
+	[STAMP_RAW] = "raw",
+};
+
+struct hc_sr04_stats {
+	long long min;
+	long long median;
+	long long mean;
+	long long stddev;
+	int valid;
+};
+
+/* Sample history, kept as a byte ring of variable length records. Each
+ * record holds, as varints, the change of the time between samples
+ * (usecs, zigzag coded), the change of the echo length (usecs, zigzag
+ * coded) and flags << 8 | errno. Near periodic pings of a slowly moving
+ * object so take about 4 bytes per sample.
+ */
+struct hc_sr04_hist_state {
+	s64 timestamp;			/* usecs */
+	s64 usecs;
+	s64 interval;
+};
+
+struct hc_sr04_history {
+	u8 *buf;			/* NULL if history is off */
+	size_t size;
+	size_t head;
+	size_t used;
+	struct hc_sr04_hist_state first;	/* before the oldest record */
+	struct hc_sr04_hist_state last;		/* the newest record */
+	u64 dropped;			/* records dropped for space */
+	u64 count;			/* records in buf */
+	u64 cursor_index;		/* where the last read stopped */
+	size_t cursor_pos;
+	struct hc_sr04_hist_state cursor;
+};
+
+#define ROLLUP_TIERS 2
+#define ROLLUP_BUCKETS 60
+
+/* Aggregates of the samples of one second or one minute. The tiers are
+ * rings of the last ROLLUP_BUCKETS periods that saw pings.
+ */
+struct hc_sr04_bucket {
+	s64 period;			/* timestamp / period length */
+	u32 count;
+	u32 errors;
+	u32 min;
+	u32 max;
+	u64 sum;
+};
+
+struct hc_sr04_tier {
+	unsigned int secs;		/* period length */
+	int cur;
+	struct hc_sr04_bucket buckets[ROLLUP_BUCKETS];
+};
+
+#define GROUP_NAME_LEN 32
+
+/* First member of the drvdata of every device in the class, tells
+ * sensors from groups.
+ */
+enum hc_sr04_kind {
+	KIND_SENSOR = 1,
+	KIND_GROUP,
+};
+
+/* Named set of sensors with the nearest echo among them. */
+struct hc_sr04_group {
+	enum hc_sr04_kind kind;
+	struct list_head list;		/* in hc_sr04_groups */
+	char name[GROUP_NAME_LEN];
+	struct device *dev;
+	struct list_head members;
+	struct hc_sr04 *nearest;	/* NULL: nothing in range */
+	long long nearest_usecs;
+	struct timespec64 nearest_time;
+};
+
+/* A GPIO whose rising edges trigger pings of the sensors on its list. */
+struct hc_sr04_ext_line {
+	struct list_head list;		/* in ext_lines */
+	int gpio;
+	int irq;
+	struct list_head sensors;
+	int nr_sensors;			/* also those finishing a ping */
+};
+
+/* Somebody asking for on-demand pings: an open file of the character
+ * device, or all sysfs reads of one user.
+ */
+struct hc_sr04_client {
+	struct list_head list;		/* in sensor->clients */
+	struct hc_sr04_reader *reader;	/* NULL for sysfs clients */
+	kuid_t uid;
+	unsigned int pending;		/* waiting sysfs reads */
+	wait_queue_head_t wait;		/* for them, woken on their turn */
+	ktime_t next_ping;		/* client_rate limit */
+};
+
+/* sysfs users with their own share of on-demand pings. */
+#define MAX_UID_CLIENTS 16
+
+/* Sensors answering a 0x55 request byte with the distance in mm over
+ * UART instead of an echo pulse.
+ */
+enum hc_sr04_serial_proto {
+	SERIAL_US100,			/* 2 bytes: mm high, low */
+	SERIAL_JSN_SR04T,		/* 4 bytes: 0xff, mm high, low, sum */
+};
 
 struct hc_sr04 {
-	int gpio_trig;
+	enum hc_sr04_kind kind;
+	struct device *dev;
+	struct kref ref;
+	int minor;
+	int removed;
+	int suspended;			/* system sleep */
+	int rpm_suspended;		/* runtime suspended, the echo IRQ
+					 * ignores edges */
+	spinlock_t lock;		/* protects readers, clients and
+					 * removed */
+	struct list_head readers;
+	struct delayed_work ping_work;
+	struct list_head clients;	/* in fair queue order */
+	struct hc_sr04_client uid_clients[MAX_UID_CLIENTS];
+	int nr_uid_clients;
+	struct hc_sr04_client *ondemand_owner;	/* of the running on-demand
+						 * ping */
+	unsigned int ondemand_cap;	/* on-demand pings/s, 0: no limit */
+	unsigned int client_rate;	/* the same per client */
+	ktime_t ondemand_next;		/* ondemand_cap limit */
+	int streamers;			/* readers in stream mode */
+	u32 stream_seq;
+	unsigned int rate;		/* Hz guaranteed to streams, 0: best
+					 * effort */
+	int priority;
+	ktime_t release;		/* next scheduled ping, CLOCK_MONOTONIC */
+	ktime_t deadline;
+	ktime_t last_scheduled;
+	unsigned long missed_deadlines;
+	unsigned int min_rate;		/* adaptive rate, off if 0 */
+	unsigned int max_rate;
+	unsigned int cur_rate;
+	unsigned long tolerance;	/* usecs */
+	long long stable_base;
+	int stable_count;
+	struct mutex history_mutex;
+	struct hc_sr04_history history;
+	struct mutex rollup_mutex;
+	struct hc_sr04_tier tiers[ROLLUP_TIERS];
+	struct serdev_device *serdev;	/* NULL for GPIO sensors */
+	enum hc_sr04_serial_proto serial_proto;
+	struct delayed_work serial_stream;
+	int rx_waiting;			/* a request is outstanding */
+	int rx_len;
+	u8 rx_buf[4];
+	unsigned int rx_mm;
+	struct completion rx_done;
+	int gpio_trig;			/* -1 for serial sensors */
 	int gpio_echo;
+	int gpio_power;			/* -1 if sensor can't be power cycled */
 	int irq;
-	struct timespec64 time_triggered;
-	struct timespec64 time_echoed;
+	ktime_t time_burst;		/* trigger issued, 0: not since
+					 * resume */
+	ktime_t time_rising;		/* echo started */
+	ktime_t time_echoed;
+	enum hc_sr04_stamp stamp_clock;	/* of the sample timestamps */
+	struct timespec64 stamp_burst;	/* time_burst in stamp_clock */
+	struct timespec64 stamp_rising;	/* time_rising in stamp_clock */
+	long long trigger_stretch;	/* usecs the trigger pulse overran */
+	int cpu_latency;		/* usecs while pinging, -1: any */
+	unsigned int range_min_mm;	/* region of interest, 0: no gate */
+	unsigned int range_max_mm;
+	long long range_min;		/* the same in usecs */
+	long long range_max;
+	struct hrtimer range_timer;	/* echo longer than range_max */
+	int out_of_range;
+	int echo_tail;			/* echo still high after the reader
+					 * was released */
+	struct pm_qos_request qos;	/* added on first use */
+	long long delay_base;		/* average echo_delay, 0: none yet */
+	long long trend_usecs;		/* average echo, 0: none yet */
+	long long offset;		/* usecs, subtracted from echoes */
 	int echo_received;
+	int echo_high;
+	int echo_started;
 	int device_triggered;
+	unsigned long burst_glitches;	/* glitches before the ping */
+	struct hc_sr04_ext_line *ext_line;	/* external trigger, or NULL */
+	struct list_head ext_list;	/* in ext_line->sensors */
+	unsigned long ext_missed;	/* external triggers ignored */
+	struct hc_sr04_group *group;	/* NULL if in no group */
+	struct list_head group_list;	/* in group->members */
+	int group_valid;		/* last reading saw something */
+	long long group_usecs;
+	struct timespec64 group_time;
+	int ext_busy;			/* external ping in flight */
+	struct work_struct ext_work;
+	int multi_edge;
+	int capturing;			/* echo window of a multi-edge ping */
+	int nr_edges;
+	int edges_lost;
+	ktime_t edge_time[HC_SR04_MAX_EDGES];
+	u32 edge_rising;		/* bit i: edge i was rising */
+	unsigned long min_pulse_width;
+	unsigned long glitches;
+	ktime_t last_burst;		/* ghost echo detection */
+	long long last_gap;
+	long long last_usecs;
+	int ghost_history;
+	unsigned long ping_gap;		/* usecs between two bursts */
+	unsigned long tuned_gap;	/* 0 if not autotuned */
+	int window_pings;
+	int window_ghosts;
+	enum hc_sr04_health health;
+	int failures;			/* consecutive timeouts */
+	unsigned long timeouts;
+	unsigned long no_echo_starts;
+	unsigned int backoff;		/* msecs */
+	unsigned long retry_at;		/* jiffies */
+	unsigned long stuck_echoes;
+	unsigned long power_cycles;
+	u64 pings;			/* finished, protected by lock */
+	int have_last;
+	struct hc_sr04_sample last;	/* last successful one */
+	int burst_count;
 	struct mutex measurement_mutex;
 	wait_queue_head_t wait_for_echo;
 	unsigned long timeout;
 	struct list_head list;
 };
 
+/* Echo pulses shorter than this (in usecs) are considered noise on the
+ * echo line. The shortest real echo (2cm) is about 116 usecs long.
+ */
+#define DEFAULT_MIN_PULSE_WIDTH 10
+
+/* The HC-SR04 gives up after a 38ms echo pulse if nothing was in range. */
+#define MAX_ECHO_USECS 38000
+
+/* Multi-edge pings listen that long after the trigger. */
+#define EDGE_WINDOW_USECS (MAX_ECHO_USECS + 2000)
+
+/* Echo length of an obstacle mm away, at 343 m/s. */
+#define MM_TO_USECS(mm) div_u64((u64) (mm) * 2000, 343)
+
+/* JSN-SR04T (mode 3) and US-100 in UART mode. */
+#define SERIAL_REQUEST 0x55
+#define SERIAL_BAUDRATE 9600
+#define SERIAL_TIMEOUT_MSECS 200
+
+/* Idle sensors have their echo IRQ (and power, if switchable) turned off
+ * that long after their last ping.
+ */
+#define AUTOSUSPEND_MSECS 2000
+
+#define PING_GAP_USECS 60000
+#define MIN_PING_GAP_USECS 5000
+
+/* Pings per step of the gap autotuning and per runtime re-validation
+ * window.
+ */
+#define AUTOTUNE_PINGS 8
+
+#define MAX_HISTORY_SIZE (64 << 20)
+#define HISTORY_RECORD_MAX 30		/* 3 varints of up to 10 bytes */
+
+#define DEFAULT_BURST_COUNT 5
+#define MAX_BURST_COUNT 32
+
+/* Pings of a calibration, against a target at most 2m away. */
+#define CALIBRATION_PINGS MAX_BURST_COUNT
+#define MAX_CALIBRATION_MM 2000
+
+/* A sensor is quarantined after that many timeouts in a row. It is then
+ * only pinged again after a backoff that doubles with every failed retry.
+ * A ping with that many glitches marks the sensor as degraded.
+ */
+#define HEALTH_FAIL_LIMIT 3
+#define HEALTH_NOISY_GLITCHES 3
+#define MIN_BACKOFF_MSECS 100
+#define MAX_BACKOFF_MSECS 60000
+
+/* Some HC-SR04 clones latch the echo line high after a missed reflection
+ * until they are power cycled. Real echo pulses end after 38ms (some
+ * clones take up to 200ms).
+ */
+#define STUCK_ECHO_MSECS 250
+#define POWER_OFF_MSECS 100
+#define POWER_ON_MSECS 50
+
+/* Ghost echoes are late reflections of the previous ping. Their distance
+ * to the previous burst is fixed, so they move when the gap between the
+ * pings changes while real echoes stay put. The gap is randomly extended
+ * by up to GHOST_DITHER_USECS to make them tell-tale.
+ */
+#define GHOST_DITHER_USECS 2000
+#define GHOST_MIN_GAP_CHANGE 300
+#define GHOST_TOLERANCE_USECS 100
+
+/* Confidence of a sample starts at 100 and loses points for each sign of
+ * disturbed timing: glitches during the ping, a trigger pulse that took
+ * longer than 10 usecs (the CPU was busy with interrupts), a trigger to
+ * echo delay off its average and an echo off the recent trend.
+ * Crosstalk and ghost samples lose another CONF_FLAG_PENALTY points.
+ */
+#define CONF_GLITCH_PENALTY 20
+#define CONF_MAX_PENALTY 30		/* of each timing term */
+#define CONF_STRETCH_USECS 2		/* per point */
+#define CONF_DELAY_USECS 10		/* per point */
+#define CONF_TREND_PERMILLE 20		/* per point */
+#define CONF_FLAG_PENALTY 50
+#define TRIGGER_USECS 10
+
+/* Recent trigger bursts of all sensors, for crosstalk detection. */
+#define BURST_LOG_SIZE 16
+
+struct hc_sr04_burst {
+	const struct hc_sr04 *sensor;	/* never dereferenced */
+	ktime_t time;
+};
+
+static struct hc_sr04_burst burst_log[BURST_LOG_SIZE];
+static unsigned int burst_log_next;
+static DEFINE_SPINLOCK(burst_log_lock);
+
 static LIST_HEAD(hc_sr04_devices);
 static DEFINE_MUTEX(devices_mutex);
 
+/* Frontend modules, see hc-sr04-core.h. Taken after devices_mutex. */
+static LIST_HEAD(hc_sr04_consumers);
+static DECLARE_RWSEM(consumers_rwsem);
+
+#define HC_SR04_MAX_MINORS 64
+
+/* The acquisition scheduler pings streaming sensors one at a time, so
+ * they can't hear each other. Sensors with a rate get earliest deadline
+ * first, best effort sensors only get airtime which no rate sensor will
+ * need within PING_BUDGET_USECS (a ping can take that long).
+ */
+#define PING_BUDGET_USECS (MAX_ECHO_USECS + 2000)
+#define SCHED_RETRY_USECS 1000
+#define MAX_RATE (USEC_PER_SEC / MIN_PING_GAP_USECS)
+
+/* An adaptive rate sensor halves its rate each time that many readings
+ * in a row stayed within the tolerance.
+ */
+#define ADAPT_STABLE_SAMPLES 4
+
+static struct task_struct *sched_task;
+static int sched_kicked;
+
+static void kick_scheduler(void)
+{
+	WRITE_ONCE(sched_kicked, 1);
+	if (sched_task != NULL)
+		wake_up_process(sched_task);
+}
+
+static DEFINE_IDR(hc_sr04_minors);	/* protected by devices_mutex */
+static dev_t hc_sr04_devt;
+static struct cdev hc_sr04_cdev;
+
+/* One per open file of a sensor's character device. The watermark
+ * fields and results are protected by sensor->lock.
+ */
+#define READER_FIFO_SIZE 64
+
+struct hc_sr04_reader {
+	struct hc_sr04 *sensor;
+	struct list_head list;		/* in sensor->readers */
+	struct kref ref;
+	u32 arm_seq;			/* last ping armed */
+	u32 start_seq;			/* last ping started */
+	u32 done_seq;			/* last ping in results */
+	int streaming;
+	unsigned int wm_samples;	/* wake up at that many results */
+	unsigned int wm_usecs;		/* or when the oldest is that old */
+	int aged;			/* oldest result older than wm_usecs */
+	struct hrtimer age_timer;
+	DECLARE_KFIFO(results, struct hc_sr04_record, READER_FIFO_SIZE);
+	wait_queue_head_t wait;
+	struct hc_sr04_client client;
+};
+
 static int setup_hc_sr04_gpio(int trig, int echo)
 {
 	int ret;
@@ -91,6 +651,29 @@ static int setup_hc_sr04_gpio(int trig, int echo)
 
 	return ret;
 }
+
+static int setup_hc_sr04_power_gpio(int power)
+{
+	int ret;
+
+	if (!gpio_is_valid(power)) {
+		pr_err("Failed validation of power GPIO %d\n", power);
+		return -EINVAL;
+	}
+
+	ret = gpio_request(power, "power");
+	if (ret < 0) {
+		pr_err("GPIO %d request failed. Exiting.\n", power);
+		return ret;
+	}
+	gpio_direction_output(power, 0);
+		/* switched on when the sensor is runtime resumed */
+
+	pr_info("hc-sr04: acquired gpio power=%d\n", power);
+
+	return ret;
+}
+
 static irqreturn_t echo_received_irq(int irq, void *data);
 static int setup_hc_sr04_irq(struct hc_sr04 *device)
 {
@@ -110,72 +693,275 @@ static int setup_hc_sr04_irq(struct hc_sr04 *device)
 		"hc_sr04", device);
 	if (ret < 0) {
 		pr_err("request_irq() failed. Exiting.\n");
+		return ret;
 	}
-	return ret;
+	return 0;
 }
 
-static struct hc_sr04 *create_hc_sr04(int trig, int echo, unsigned long timeout)
+static void ping_work_fn(struct work_struct *work);
+static void ext_work_fn(struct work_struct *work);
+static void serial_stream_fn(struct work_struct *work);
+static void init_sensor(struct hc_sr04 *new, unsigned long timeout);
+
+static struct hc_sr04 *create_hc_sr04(int trig, int echo, unsigned long timeout,
+				      int power)
 		/* must be called with devices_mutex held */
 {
 	struct hc_sr04 *new;
 	int err;
 
-	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
 	if (new == NULL)
 		return ERR_PTR(-ENOMEM);
 
+	new->minor = idr_alloc(&hc_sr04_minors, new, 0, HC_SR04_MAX_MINORS,
+			       GFP_KERNEL);
+	if (new->minor < 0) {
+		err = new->minor;
+		kfree(new);
+		return ERR_PTR(err);
+	}
+
 	new->gpio_echo = echo;
 	new->gpio_trig = trig;
+	new->gpio_power = power;
 
 	err = setup_hc_sr04_gpio(new->gpio_trig, new->gpio_echo);
 	if (err != 0) {
+		idr_remove(&hc_sr04_minors, new->minor);
 		kfree(new);
 		return ERR_PTR(err);
 	}
 
-	mutex_init(&new->measurement_mutex);
-	init_waitqueue_head(&new->wait_for_echo);
-	new->timeout = timeout;
+	if (new->gpio_power >= 0) {
+		err = setup_hc_sr04_power_gpio(new->gpio_power);
+		if (err != 0) {
+			gpio_free(new->gpio_trig);
+			gpio_free(new->gpio_echo);
+			idr_remove(&hc_sr04_minors, new->minor);
+			kfree(new);
+			return ERR_PTR(err);
+		}
+	}
+
+	init_sensor(new, timeout);
 
 	err = setup_hc_sr04_irq(new);
 	if (err != 0) {
 		gpio_free(new->gpio_trig);
 		gpio_free(new->gpio_echo);
+		if (new->gpio_power >= 0)
+			gpio_free(new->gpio_power);
+		idr_remove(&hc_sr04_minors, new->minor);
+		kfree(new);
+		return ERR_PTR(err);
+	}
+
+	list_add_tail(&new->list, &hc_sr04_devices);
+
+	return new;
+}
+
+static enum hrtimer_restart range_expired(struct hrtimer *timer);
+
+static void init_sensor(struct hc_sr04 *new, unsigned long timeout)
+{
+	int i;
+
+	new->kind = KIND_SENSOR;
+	new->rpm_suspended = 1;
+	kref_init(&new->ref);
+	spin_lock_init(&new->lock);
+	INIT_LIST_HEAD(&new->readers);
+	INIT_DELAYED_WORK(&new->ping_work, ping_work_fn);
+	INIT_WORK(&new->ext_work, ext_work_fn);
+	INIT_LIST_HEAD(&new->clients);
+	for (i = 0; i < MAX_UID_CLIENTS; i++)
+		init_waitqueue_head(&new->uid_clients[i].wait);
+	mutex_init(&new->measurement_mutex);
+	mutex_init(&new->history_mutex);
+	mutex_init(&new->rollup_mutex);
+	new->tiers[0].secs = 1;
+	new->tiers[1].secs = 60;
+	init_waitqueue_head(&new->wait_for_echo);
+	new->timeout = timeout;
+	new->min_pulse_width = DEFAULT_MIN_PULSE_WIDTH;
+	new->ping_gap = PING_GAP_USECS;
+	new->burst_count = DEFAULT_BURST_COUNT;
+	new->cpu_latency = -1;
+	hrtimer_init(&new->range_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	new->range_timer.function = range_expired;
+	INIT_DELAYED_WORK(&new->serial_stream, serial_stream_fn);
+	init_completion(&new->rx_done);
+}
+
+static struct hc_sr04 *create_serial_hc_sr04(struct serdev_device *serdev,
+					     enum hc_sr04_serial_proto proto)
+		/* must be called with devices_mutex held */
+{
+	struct hc_sr04 *new;
+	int err;
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (new == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	new->minor = idr_alloc(&hc_sr04_minors, new, 0, HC_SR04_MAX_MINORS,
+			       GFP_KERNEL);
+	if (new->minor < 0) {
+		err = new->minor;
 		kfree(new);
 		return ERR_PTR(err);
 	}
 
+	new->gpio_trig = -1;
+	new->gpio_echo = -1;
+	new->gpio_power = -1;
+	new->irq = -1;
+	new->serdev = serdev;
+	new->serial_proto = proto;
+	init_sensor(new, msecs_to_jiffies(SERIAL_TIMEOUT_MSECS));
+	serdev_device_set_drvdata(serdev, new);
+
+	err = serdev_device_open(serdev);
+	if (err < 0) {
+		idr_remove(&hc_sr04_minors, new->minor);
+		kfree(new);
+		return ERR_PTR(err);
+	}
+	serdev_device_set_baudrate(serdev, SERIAL_BAUDRATE);
+	serdev_device_set_flow_control(serdev, false);
+	serdev_device_set_parity(serdev, SERDEV_PARITY_NONE);
+
 	list_add_tail(&new->list, &hc_sr04_devices);
 
 	return new;
 }
 
+static void forget_bursts(struct hc_sr04 *device);
+
+static void free_hc_sr04(struct kref *ref)
+{
+	struct hc_sr04 *device = container_of(ref, struct hc_sr04, ref);
+
+	kvfree(device->history.buf);
+	kfree(device);
+}
+
+/* The memory stays around until the last open file is closed. */
+
 static void destroy_hc_sr04(struct hc_sr04 *device)
 {
 	list_del(&device->list);
-	free_irq(device->irq, device);
-	gpio_free(device->gpio_echo);
-	gpio_free(device->gpio_trig);
-	kfree(device);
+	idr_remove(&hc_sr04_minors, device->minor);
+	forget_bursts(device);
+	if (device->serdev != NULL) {
+		serdev_device_close(device->serdev);
+	} else {
+		free_irq(device->irq, device);
+		hrtimer_cancel(&device->range_timer);
+		gpio_free(device->gpio_echo);
+		gpio_free(device->gpio_trig);
+	}
+	if (device->gpio_power >= 0)
+		gpio_free(device->gpio_power);
+	if (cpu_latency_qos_request_active(&device->qos))
+		cpu_latency_qos_remove_request(&device->qos);
+	kref_put(&device->ref, free_hc_sr04);
+}
+
+/* Intervals are measured on CLOCK_MONOTONIC (ktime_get()), so setting
+ * the wall clock can't stretch a wait. The clock of the sample timestamps
+ * is only read for the stamps.
+ */
+static long long usecs_between(ktime_t from, ktime_t to)
+{
+	return ktime_us_delta(to, from);
+}
+
+/* Reads the clock of the sample timestamps, from hard IRQ too. */
+static void read_stamp(struct hc_sr04 *device, struct timespec64 *ts)
+{
+	switch (READ_ONCE(device->stamp_clock)) {
+	case STAMP_REALTIME:
+		ktime_get_real_ts64(ts);
+		break;
+	case STAMP_MONOTONIC:
+		ktime_get_ts64(ts);
+		break;
+	case STAMP_BOOTTIME:
+		ktime_get_boottime_ts64(ts);
+		break;
+	case STAMP_TAI:
+		ktime_get_clocktai_ts64(ts);
+		break;
+	case STAMP_RAW:
+		ktime_get_raw_ts64(ts);
+		break;
+	}
 }
 
 static irqreturn_t echo_received_irq(int irq, void *data)
 {
 	struct hc_sr04 *device = (struct hc_sr04 *) data;
 	int val;
-	struct timespec64 irq_ts;
+	struct timespec64 stamp_ts;
+	ktime_t irq_ts;
+
+	if (READ_ONCE(device->rpm_suspended))
+		return IRQ_HANDLED;
+		/* the line may be shared, so it stays enabled. Claim the
+		 * edges a powered down sensor may still produce, or the
+		 * spurious IRQ detector would disable the line. */
 
-	ktime_get_real_ts64(&irq_ts);
+	irq_ts = ktime_get();
+	read_stamp(device, &stamp_ts);
 
-	if (!device->device_triggered)
+	val = __gpio_get_value(device->gpio_echo);
+	if (!device->device_triggered) {
+		if (device->echo_tail && val == 0) {
+			device->echo_tail = 0;
+			wake_up_interruptible(&device->wait_for_echo);
+		}
+			/* the sensor can be triggered again */
 		return IRQ_HANDLED;
+	}
+	if (device->capturing) {
+		if (device->nr_edges < HC_SR04_MAX_EDGES) {
+			device->edge_time[device->nr_edges] = irq_ts;
+			if (val == 1)
+				device->edge_rising |= 1 << device->nr_edges;
+			device->nr_edges++;
+		} else {
+			device->edges_lost = 1;
+		}
+	}
 	if (device->echo_received)
 		return IRQ_HANDLED;
 
-	val = __gpio_get_value(device->gpio_echo);
 	if (val == 1) {
-		device->time_triggered = irq_ts;
+			/* re-arm on every rising edge, so the real echo
+			 * still gets measured after a discarded glitch.
+			 */
+		device->time_rising = irq_ts;
+		device->stamp_rising = stamp_ts;
+		device->echo_high = 1;
+		device->echo_started = 1;
+		if (device->range_max > 0)
+			hrtimer_start(&device->range_timer,
+				      ns_to_ktime(device->range_max *
+						  NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
 	} else {
+		if (!device->echo_high)
+			return IRQ_HANDLED;
+		device->echo_high = 0;
+
+		if (usecs_between(device->time_rising, irq_ts) <
+		    device->min_pulse_width) {
+			device->glitches++;
+			return IRQ_HANDLED;
+		}
 		device->time_echoed = irq_ts;
 		device->echo_received = 1;
 		wake_up_interruptible(&device->wait_for_echo);
@@ -184,114 +970,3241 @@ static irqreturn_t echo_received_irq(int irq, void *data)
 	return IRQ_HANDLED;
 }
 
-/* devices_mutex must be held by caller, so nobody deletes the device
- * before we lock it.
+/* The echo is longer than the region of interest: release the reader
+ * without waiting for the end of it.
  */
-
-static int do_measurement(struct hc_sr04 *device,
-			  unsigned long long *usecs_elapsed)
+static enum hrtimer_restart range_expired(struct hrtimer *timer)
 {
-	long timeout;
-	int ret;
+	struct hc_sr04 *device = container_of(timer, struct hc_sr04,
+					      range_timer);
 
-	if (!mutex_trylock(&device->measurement_mutex)) {
-		mutex_unlock(&devices_mutex);
-		return -EBUSY;
+	if (device->device_triggered && device->echo_high &&
+	    !device->echo_received) {
+		WRITE_ONCE(device->out_of_range, 1);
+		wake_up_interruptible(&device->wait_for_echo);
 	}
-	mutex_unlock(&devices_mutex);
+	return HRTIMER_NORESTART;
+}
 
-	msleep(60);
-		/* wait 60 ms between measurements.
-		 * now, a while true ; do cat measure ; done should work
-		 */
+static void log_burst(struct hc_sr04 *device)
+{
+	unsigned long flags;
 
-	device->echo_received = 0;
-	device->device_triggered = 0;
+	spin_lock_irqsave(&burst_log_lock, flags);
+	burst_log[burst_log_next].sensor = device;
+	burst_log[burst_log_next].time = device->time_burst;
+	burst_log_next = (burst_log_next + 1) % BURST_LOG_SIZE;
+	spin_unlock_irqrestore(&burst_log_lock, flags);
+}
 
-	gpio_set_value(device->gpio_trig, 1);
-	udelay(10);
-	device->device_triggered = 1;
-	gpio_set_value(device->gpio_trig, 0);
+static void forget_bursts(struct hc_sr04 *device)
+{
+	int i;
 
-	timeout = wait_event_interruptible_timeout(device->wait_for_echo,
-				device->echo_received, device->timeout);
+	spin_lock_irq(&burst_log_lock);
+	for (i = 0; i < BURST_LOG_SIZE; i++)
+		if (burst_log[i].sensor == device)
+			burst_log[i].sensor = NULL;
+	spin_unlock_irq(&burst_log_lock);
+}
 
-	if (timeout == 0)
-		ret = -ETIMEDOUT;
-	else if (timeout < 0)
-		ret = timeout;
-	else {
-		*usecs_elapsed =
-	(device->time_echoed.tv_sec - device->time_triggered.tv_sec) * 1000000 +
-	(device->time_echoed.tv_nsec - device->time_triggered.tv_nsec) / 1000;
-		ret = 0;
-	}
+/* Any other burst from up to a full echo length before our own burst
+ * until the end of our echo may be what our sensor has heard.
+ */
+static int crosstalk_suspected(struct hc_sr04 *device)
+{
+	struct hc_sr04_burst *burst;
+	int i, ret;
 
-	mutex_unlock(&device->measurement_mutex);
+	ret = 0;
+	spin_lock_irq(&burst_log_lock);
+	for (i = 0; i < BURST_LOG_SIZE; i++) {
+		burst = &burst_log[i];
+		if (burst->sensor == NULL || burst->sensor == device)
+			continue;
+		if (usecs_between(device->time_burst, burst->time) >
+				-MAX_ECHO_USECS &&
+		    usecs_between(burst->time, device->time_echoed) > 0) {
+			ret = 1;
+			break;
+		}
+	}
+	spin_unlock_irq(&burst_log_lock);
 
 	return ret;
 }
 
-static ssize_t sysfs_do_measurement(struct device *dev,
-				    struct device_attribute *attr,
-				    char *buf)
+/* Needs three pings in a row: a ghost is suspected if the echo changed by
+ * the same amount the gap changed, in the opposite direction.
+ */
+static int ghost_suspected(struct hc_sr04 *device, long long usecs)
 {
-	struct hc_sr04 *sensor = dev_get_drvdata(dev);
-	unsigned long long usecs_elapsed;
-	int status;
+	long long gap, gap_change, echo_change;
+	int ret;
 
-	mutex_lock(&devices_mutex);
-	status = do_measurement(sensor, &usecs_elapsed);
+	ret = 0;
+	gap = 0;
+	if (device->ghost_history > 0)
+		gap = usecs_between(device->last_burst, device->time_burst);
+
+	if (device->ghost_history > 1) {
+		gap_change = gap - device->last_gap;
+		echo_change = usecs - device->last_usecs;
 
-	if (status < 0)
-		return status;
+		if (abs(gap_change) >= GHOST_MIN_GAP_CHANGE &&
+		    abs(echo_change + gap_change) < GHOST_TOLERANCE_USECS)
+			ret = 1;
+	} else {
+		device->ghost_history++;
+	}
+	device->last_burst = device->time_burst;
+	device->last_gap = gap;
+	device->last_usecs = usecs;
 
-	return sprintf(buf, "%lld\n", usecs_elapsed);
+	return ret;
 }
 
-DEVICE_ATTR(measure, 0444, sysfs_do_measurement, NULL);
+/* Runtime re-validation of an autotuned gap: back off as soon as ghosts
+ * show up, creep back to the tuned gap while the echoes are clean.
+ */
+static void revalidate_gap(struct hc_sr04 *device, int ghost)
+{
+	if (device->tuned_gap == 0)
+		return;
 
+	device->window_pings++;
+	if (ghost)
+		device->window_ghosts++;
+	if (device->window_pings < AUTOTUNE_PINGS)
+		return;
 
-static struct attribute *sensor_attrs[] = {
-	&dev_attr_measure.attr,
-	NULL,
-};
+	if (device->window_ghosts > 0)
+		device->ping_gap = min(device->ping_gap * 5 / 4,
+				       (unsigned long) PING_GAP_USECS);
+	else if (device->ping_gap > device->tuned_gap)
+		device->ping_gap = max(device->ping_gap * 4 / 5,
+				       device->tuned_gap);
 
-static const struct attribute_group sensor_group = {
-	.attrs = sensor_attrs
-};
+	device->window_pings = 0;
+	device->window_ghosts = 0;
+}
 
-static const struct attribute_group *sensor_groups[] = {
-	&sensor_group,
-	NULL
-};
+static void set_health(struct hc_sr04 *device, enum hc_sr04_health health)
+{
+	if (device->health == health)
+		return;
 
-static ssize_t configure_store(struct class *class,
-				struct class_attribute *attr,
-				const char *buf, size_t len);
+	device->health = health;
+	sysfs_notify(&device->dev->kobj, NULL, "health");
+}
 
-static CLASS_ATTR_WO(configure);
+static void update_health(struct hc_sr04 *device, int err,
+			  unsigned long glitches)
+{
+	if (err == 0 || err == -ERANGE) {
+		device->failures = 0;
+		device->backoff = 0;
+		set_health(device, glitches >= HEALTH_NOISY_GLITCHES ?
+				   HEALTH_DEGRADED : HEALTH_OK);
+		return;
+	}
+	if (err != -ETIMEDOUT && err != -EIO)
+		return;
 
-static struct attribute *hc_sr04_class_attrs[] = {
-	&class_attr_configure.attr,
-	NULL,
+	if (err == -ETIMEDOUT) {
+		device->timeouts++;
+		if (!device->echo_started)
+			device->no_echo_starts++;
+	}
+
+	if (++device->failures < HEALTH_FAIL_LIMIT) {
+		set_health(device, HEALTH_DEGRADED);
+		return;
+	}
+
+	if (device->backoff == 0)
+		device->backoff = MIN_BACKOFF_MSECS;
+	else
+		device->backoff = min_t(unsigned int, device->backoff * 2,
+					MAX_BACKOFF_MSECS);
+	device->retry_at = jiffies + msecs_to_jiffies(device->backoff);
+	set_health(device, HEALTH_FAILED);
+}
+
+static int recover_stuck_echo(struct hc_sr04 *device)
+{
+	device->stuck_echoes++;
+	if (device->gpio_power < 0) {
+		pr_warn_ratelimited("hc-sr04: echo GPIO %d stuck high\n",
+				    device->gpio_echo);
+		return -EIO;
+	}
+
+	pr_warn_ratelimited("hc-sr04: echo GPIO %d stuck high, power cycling sensor\n",
+			    device->gpio_echo);
+	gpio_set_value(device->gpio_power, 0);
+	msleep(POWER_OFF_MSECS);
+	gpio_set_value(device->gpio_power, 1);
+	msleep(POWER_ON_MSECS);
+	device->power_cycles++;
+
+	if (gpio_get_value(device->gpio_echo))
+		return -EIO;
+	return 0;
+}
+
+/* An echo pulse still running from the last ping gets some time to end,
+ * after that the echo line is considered stuck.
+ */
+static int wait_for_echo_low(struct hc_sr04 *device)
+{
+	unsigned long deadline;
+
+	deadline = jiffies + msecs_to_jiffies(STUCK_ECHO_MSECS);
+	while (gpio_get_value(device->gpio_echo)) {
+		if (time_after(jiffies, deadline))
+			return recover_stuck_echo(device);
+		msleep(10);
+	}
+	return 0;
+}
+
+static u64 zigzag(s64 v)
+{
+	return ((u64) v << 1) ^ (u64) (v >> 63);
+}
+
+static s64 unzigzag(u64 v)
+{
+	return (s64) (v >> 1) ^ -(s64) (v & 1);
+}
+
+static int put_varint(u8 *p, u64 v)
+{
+	int n;
+
+	n = 0;
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+static u64 hist_get_varint(const struct hc_sr04_history *h, size_t *pos)
+{
+	u64 v;
+	int shift;
+	u8 b;
+
+	v = 0;
+	shift = 0;
+	do {
+		b = h->buf[*pos];
+		if (++*pos == h->size)
+			*pos = 0;
+		v |= (u64) (b & 0x7f) << shift;
+		shift += 7;
+	} while ((b & 0x80) && shift < 64);
+
+	return v;
+}
+
+/* Decodes the record at *pos following state, which is updated. */
+static u32 hist_decode(const struct hc_sr04_history *h, size_t *pos,
+		       struct hc_sr04_hist_state *state)
+{
+	state->interval += unzigzag(hist_get_varint(h, pos));
+	state->timestamp += state->interval;
+	state->usecs += unzigzag(hist_get_varint(h, pos));
+
+	return hist_get_varint(h, pos);
+}
+
+static size_t hist_tail(const struct hc_sr04_history *h)
+{
+	return (h->head + h->size - h->used) % h->size;
+}
+
+static void hist_drop_oldest(struct hc_sr04_history *h)
+{
+	size_t pos, tail;
+
+	tail = hist_tail(h);
+	pos = tail;
+	hist_decode(h, &pos, &h->first);
+	h->used -= (pos + h->size - tail) % h->size;
+	h->count--;
+	h->dropped++;
+}
+
+/* history_mutex must be held by caller. Errors are stored with the time
+ * of the burst and the last echo length.
+ */
+static void history_add(struct hc_sr04 *device, int err,
+			const struct hc_sr04_sample *sample)
+{
+	struct hc_sr04_history *h = &device->history;
+	struct hc_sr04_hist_state next;
+	u8 record[HISTORY_RECORD_MAX];
+	int i, len;
+
+	if (h->buf == NULL)
+		return;
+
+	next = h->last;
+	if (err == 0) {
+		next.timestamp = div_s64(timespec64_to_ns(&sample->timestamp),
+					 NSEC_PER_USEC);
+		next.usecs = sample->usecs;
+	} else {
+		next.timestamp = div_s64(timespec64_to_ns(&device->stamp_burst),
+					 NSEC_PER_USEC);
+	}
+	if (h->count == 0 && h->dropped == 0) {
+		h->first = next;
+		h->first.interval = 0;
+		h->last = h->first;
+	}
+	next.interval = next.timestamp - h->last.timestamp;
+
+	len = put_varint(record, zigzag(next.interval - h->last.interval));
+	len += put_varint(record + len, zigzag(next.usecs - h->last.usecs));
+	len += put_varint(record + len,
+			  (u64) (err == 0 ? sample->flags : 0) << 8 |
+			  (-err & 0xff));
+
+	while (h->size - h->used < len)
+		hist_drop_oldest(h);
+
+	for (i = 0; i < len; i++) {
+		h->buf[h->head] = record[i];
+		if (++h->head == h->size)
+			h->head = 0;
+	}
+	h->used += len;
+	h->count++;
+	h->last = next;
+}
+
+/* history_mutex must be held by caller. Decodes up to n records starting
+ * at index (counted from the oldest record ever stored). Sequential reads
+ * continue where the last one stopped instead of decoding from the start.
+ */
+static int history_read(struct hc_sr04_history *h, u64 index,
+			struct hc_sr04_record *records, int n)
+{
+	struct hc_sr04_hist_state state;
+	size_t pos;
+	u64 i;
+	u32 v;
+	int got;
+
+	if (h->buf == NULL || index >= h->dropped + h->count)
+		return 0;
+	if (index < h->dropped)
+		return -ENODATA;
+		/* overwritten since the read started */
+
+	if (h->cursor_index >= h->dropped && h->cursor_index <= index) {
+		i = h->cursor_index;
+		pos = h->cursor_pos;
+		state = h->cursor;
+	} else {
+		i = h->dropped;
+		pos = hist_tail(h);
+		state = h->first;
+	}
+	for (; i < index; i++)
+		hist_decode(h, &pos, &state);
+
+	for (got = 0; got < n && i < h->dropped + h->count; got++, i++) {
+		v = hist_decode(h, &pos, &state);
+		records[got].seq = i;
+		records[got].status = -(s32) (v & 0xff);
+		records[got].timestamp_ns = state.timestamp * NSEC_PER_USEC;
+		records[got].usecs = state.usecs;
+		records[got].flags = v >> 8;
+	}
+	h->cursor_index = i;
+	h->cursor_pos = pos;
+	h->cursor = state;
+
+	return got;
+}
+
+/* rollup_mutex must be held by caller. Samples that went back in time
+ * (clock set) are counted in the current period.
+ */
+static void rollup_add(struct hc_sr04 *device, int err, s64 secs, u32 usecs)
+{
+	struct hc_sr04_tier *tier;
+	struct hc_sr04_bucket *b;
+	s64 period;
+	int i;
+
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		tier = &device->tiers[i];
+		period = div_s64(secs, tier->secs);
+		b = &tier->buckets[tier->cur];
+		if (period > b->period || b->count + b->errors == 0) {
+			if (b->count + b->errors != 0) {
+				tier->cur = (tier->cur + 1) % ROLLUP_BUCKETS;
+				b = &tier->buckets[tier->cur];
+			}
+			memset(b, 0, sizeof(*b));
+			b->period = period;
+		}
+		if (err < 0) {
+			b->errors++;
+			continue;
+		}
+		if (b->count == 0 || usecs < b->min)
+			b->min = usecs;
+		if (usecs > b->max)
+			b->max = usecs;
+		b->sum += usecs;
+		b->count++;
+	}
+}
+
+/* Listens for edges until the echo window is over and copies them into
+ * the sample, if any.
+ */
+static void capture_edges(struct hc_sr04 *device,
+			  struct hc_sr04_sample *sample)
+{
+	long long wait;
+	int i;
+
+	wait = EDGE_WINDOW_USECS - usecs_between(device->time_burst,
+						 ktime_get());
+	if (wait > 0 && sample != NULL)
+		usleep_range(wait, wait + 100);
+
+	WRITE_ONCE(device->capturing, 0);
+	synchronize_irq(device->irq);
+
+	if (sample == NULL)
+		return;
+	for (i = 0; i < device->nr_edges; i++) {
+		wait = usecs_between(device->time_burst, device->edge_time[i]);
+		sample->edges[i] = clamp_val(wait, 0, HC_SR04_EDGE_USECS);
+		if (device->edge_rising & (1 << i))
+			sample->edges[i] |= HC_SR04_EDGE_RISING;
+	}
+	sample->nr_edges = device->nr_edges;
+}
+
+static void update_group(struct hc_sr04 *device, int err,
+			 const struct hc_sr04_sample *sample);
+static void account_ping(struct hc_sr04 *device, int ret,
+			 const struct hc_sr04_sample *sample);
+
+/* Fires the trigger pulse. Also called from the external trigger IRQ. */
+
+static void trigger_sensor(struct hc_sr04 *device)
+{
+	ktime_t start;
+
+	device->echo_received = 0;
+	device->echo_high = 0;
+	device->echo_started = 0;
+	device->device_triggered = 0;
+	device->nr_edges = 0;
+	device->edges_lost = 0;
+	device->edge_rising = 0;
+	device->capturing = device->multi_edge;
+	device->burst_glitches = device->glitches;
+	device->out_of_range = 0;
+	device->echo_tail = 0;
+
+	start = ktime_get();
+	gpio_set_value(device->gpio_trig, 1);
+	udelay(TRIGGER_USECS);
+	device->device_triggered = 1;
+	gpio_set_value(device->gpio_trig, 0);
+	device->time_burst = ktime_get();
+	device->trigger_stretch = usecs_between(start, device->time_burst) -
+				  TRIGGER_USECS;
+	read_stamp(device, &device->stamp_burst);
+	log_burst(device);
+}
+
+/* Rates a successful sample from 0 to 100 (see CONF_GLITCH_PENALTY) and
+ * updates the averages it is compared to, with clean samples only so
+ * that ghosts and out of range echoes don't drag them along.
+ */
+static unsigned int rate_sample(struct hc_sr04 *device,
+				const struct hc_sr04_sample *sample)
+{
+	long long penalty, dev;
+
+	penalty = CONF_GLITCH_PENALTY *
+		  (long long) (device->glitches - device->burst_glitches);
+	penalty += min_t(long long, CONF_MAX_PENALTY,
+			 max(device->trigger_stretch, 0LL) /
+			 CONF_STRETCH_USECS);
+	if (device->delay_base > 0) {
+		dev = abs(sample->echo_delay - device->delay_base);
+		penalty += min_t(long long, CONF_MAX_PENALTY,
+				 dev / CONF_DELAY_USECS);
+	}
+	if (device->trend_usecs > 0) {
+		dev = abs(sample->usecs - device->trend_usecs);
+		penalty += min_t(long long, CONF_MAX_PENALTY,
+				 div_s64(dev * 1000, device->trend_usecs) /
+				 CONF_TREND_PERMILLE);
+	}
+	if (sample->flags & (HC_SR04_SAMPLE_CROSSTALK | HC_SR04_SAMPLE_GHOST))
+		penalty += CONF_FLAG_PENALTY;
+
+	if (sample->flags & (HC_SR04_SAMPLE_CROSSTALK | HC_SR04_SAMPLE_GHOST |
+			     HC_SR04_SAMPLE_OUT_OF_RANGE))
+		return 100 - clamp_val(penalty, 0, 100);
+
+	if (sample->echo_delay > 0)
+		device->delay_base = device->delay_base ?
+			device->delay_base +
+			(sample->echo_delay - device->delay_base) / 8 :
+			sample->echo_delay;
+	if (sample->usecs > 0)
+		device->trend_usecs = device->trend_usecs ?
+			device->trend_usecs +
+			(sample->usecs - device->trend_usecs) / 4 :
+			sample->usecs;
+
+	return 100 - clamp_val(penalty, 0, 100);
+}
+
+/* Samples outside range_min to range_max (if set) fail with ERANGE and
+ * are flagged.
+ */
+static int gate_sample(struct hc_sr04 *device, struct hc_sr04_sample *sample)
+{
+	if ((device->range_min > 0 && sample->usecs < device->range_min) ||
+	    (device->range_max > 0 && sample->usecs > device->range_max)) {
+		sample->flags |= HC_SR04_SAMPLE_OUT_OF_RANGE;
+		return -ERANGE;
+	}
+	return 0;
+}
+
+/* Waits for the echo of a triggered ping and evaluates it. Once the echo
+ * is longer than range_max the reader gets ERANGE right away, and the
+ * echo interrupt reports the end of the echo (echo_tail) to the next
+ * ping.
+ */
+
+static int finish_ping(struct hc_sr04 *device, struct hc_sr04_sample *sample)
+{
+	long timeout;
+	int ret;
+
+	sample->nr_edges = 0;
+	timeout = wait_event_interruptible_timeout(device->wait_for_echo,
+				device->echo_received ||
+				READ_ONCE(device->out_of_range) ||
+				READ_ONCE(device->suspended),
+				device->timeout);
+	if (timeout > 0 && !device->echo_received &&
+	    !READ_ONCE(device->suspended))
+		timeout = -ERANGE;
+		/* echo longer than range_max, don't wait for its end */
+	else if (timeout > 0 && !device->echo_received)
+		timeout = -EAGAIN;
+		/* system goes to sleep, drop the ping */
+	if (device->capturing)
+		capture_edges(device, timeout > 0 ? sample : NULL);
+	if (timeout == -ERANGE)
+		device->echo_tail = 1;
+	WRITE_ONCE(device->device_triggered, 0);
+	synchronize_irq(device->irq);
+	hrtimer_cancel(&device->range_timer);
+		/* no edge can re-arm the timer once we are not triggered */
+
+	if (timeout == 0)
+		ret = -ETIMEDOUT;
+	else if (timeout == -ERANGE) {
+		sample->timestamp = device->stamp_rising;
+		sample->usecs = usecs_between(device->time_rising,
+					      ktime_get()) - device->offset;
+		sample->echo_delay = usecs_between(device->time_burst,
+						   device->time_rising);
+		sample->flags = HC_SR04_SAMPLE_OUT_OF_RANGE;
+		sample->confidence = 0;
+		ret = -ERANGE;
+	} else if (timeout < 0)
+		ret = timeout;
+	else {
+		sample->timestamp = device->stamp_rising;
+		sample->usecs = max(usecs_between(device->time_rising,
+						  device->time_echoed) -
+				    device->offset, 0LL);
+		sample->echo_delay = usecs_between(device->time_burst,
+						   device->time_rising);
+		sample->flags = 0;
+		if (device->multi_edge && device->edges_lost)
+			sample->flags |= HC_SR04_SAMPLE_EDGES_LOST;
+		if (crosstalk_suspected(device))
+			sample->flags |= HC_SR04_SAMPLE_CROSSTALK;
+		if (ghost_suspected(device, sample->usecs))
+			sample->flags |= HC_SR04_SAMPLE_GHOST;
+		revalidate_gap(device,
+			       sample->flags & HC_SR04_SAMPLE_GHOST);
+		ret = gate_sample(device, sample);
+		sample->confidence = rate_sample(device, sample);
+	}
+	if (ret < 0)
+		device->ghost_history = 0;
+	account_ping(device, ret, sample);
+
+	return ret;
+}
+
+/* Feeds a finished ping of any kind of sensor to health, groups, history,
+ * rollups and the frontends.
+ */
+static void account_ping(struct hc_sr04 *device, int ret,
+			 const struct hc_sr04_sample *sample)
+{
+	struct hc_sr04_consumer *consumer;
+
+	update_health(device, ret, device->glitches - device->burst_glitches);
+	update_group(device, ret, sample);
+
+	spin_lock(&device->lock);
+	device->pings++;
+	if (ret == 0) {
+		device->last = *sample;
+		device->have_last = 1;
+	}
+	spin_unlock(&device->lock);
+
+	if (ret == 0 || ret == -ETIMEDOUT) {
+		mutex_lock(&device->history_mutex);
+		history_add(device, ret, sample);
+		mutex_unlock(&device->history_mutex);
+
+		mutex_lock(&device->rollup_mutex);
+		if (ret == 0)
+			rollup_add(device, 0, sample->timestamp.tv_sec,
+				   sample->usecs);
+		else
+			rollup_add(device, ret, device->stamp_burst.tv_sec, 0);
+		mutex_unlock(&device->rollup_mutex);
+	}
+
+	down_read(&consumers_rwsem);
+	list_for_each_entry(consumer, &hc_sr04_consumers, list)
+		if (consumer->sample)
+			consumer->sample(device, ret, sample);
+	up_read(&consumers_rwsem);
+}
+
+/* Serial sensors. The request is answered within about 100ms, bytes
+ * arriving while no request is outstanding are dropped and a JSN-SR04T
+ * frame with a wrong checksum makes us wait for the next 0xff.
+ */
+
+static int serial_frame_len(struct hc_sr04 *device)
+{
+	return device->serial_proto == SERIAL_US100 ? 2 : 4;
+}
+
+static int serial_receive_buf(struct serdev_device *serdev,
+			      const unsigned char *data, size_t count)
+{
+	struct hc_sr04 *device = serdev_device_get_drvdata(serdev);
+	u8 *f = device->rx_buf;
+	size_t i;
+
+	spin_lock(&device->lock);
+	for (i = 0; i < count && device->rx_waiting; i++) {
+		if (device->serial_proto == SERIAL_JSN_SR04T &&
+		    device->rx_len == 0 && data[i] != 0xff)
+			continue;
+		f[device->rx_len++] = data[i];
+		if (device->rx_len < serial_frame_len(device))
+			continue;
+
+		device->rx_len = 0;
+		if (device->serial_proto == SERIAL_US100) {
+			device->rx_mm = f[0] << 8 | f[1];
+		} else {
+			if (((f[0] + f[1] + f[2]) & 0xff) != f[3])
+				continue;
+			device->rx_mm = f[1] << 8 | f[2];
+		}
+		device->rx_waiting = 0;
+		complete(&device->rx_done);
+	}
+	spin_unlock(&device->lock);
+
+	return count;
+}
+
+static const struct serdev_device_ops serial_ops = {
+	.receive_buf = serial_receive_buf,
+	.write_wakeup = serdev_device_write_wakeup,
+};
+
+/* The distance is turned into the echo length an HC-SR04 would have
+ * measured, so everything downstream stays the same. 0 means nothing in
+ * range.
+ */
+static int serial_ping(struct hc_sr04 *device, struct hc_sr04_sample *sample)
+{
+	static const u8 request = SERIAL_REQUEST;
+	long timeout;
+	int ret;
+
+	device->burst_glitches = device->glitches;
+	sample->nr_edges = 0;
+
+	device->trigger_stretch = 0;
+
+	spin_lock(&device->lock);
+	device->rx_len = 0;
+	device->rx_waiting = 1;
+	reinit_completion(&device->rx_done);
+	spin_unlock(&device->lock);
+
+	device->time_burst = ktime_get();
+	read_stamp(device, &device->stamp_burst);
+	ret = serdev_device_write_buf(device->serdev, &request, 1);
+	if (ret == 1) {
+		timeout = wait_for_completion_interruptible_timeout(
+				&device->rx_done, device->timeout);
+		if (READ_ONCE(device->suspended))
+			ret = -EAGAIN;
+		else if (timeout == 0 || (timeout > 0 && device->rx_mm == 0))
+			ret = -ETIMEDOUT;
+		else if (timeout < 0)
+			ret = timeout;
+		else
+			ret = 0;
+	} else if (ret >= 0) {
+		ret = -EIO;
+	}
+
+	spin_lock(&device->lock);
+	device->rx_waiting = 0;
+	spin_unlock(&device->lock);
+
+	if (ret == 0) {
+		sample->timestamp = device->stamp_burst;
+		sample->usecs = max((long long) MM_TO_USECS(device->rx_mm) -
+				    device->offset, 0LL);
+		sample->echo_delay = 0;
+		sample->flags = 0;
+		ret = gate_sample(device, sample);
+		sample->confidence = rate_sample(device, sample);
+	}
+	account_ping(device, ret, sample);
+
+	return ret;
+}
+
+/* Keeps the CPUs out of idle states that take longer than cpu_latency
+ * usecs to leave while a ping is in flight, so the echo IRQ timestamps
+ * don't include the wakeup. Sensors with an external trigger hold it all
+ * the time, their pings start in hard IRQ. measurement_mutex must be
+ * held.
+ */
+static void hold_cpu_latency(struct hc_sr04 *device)
+{
+	if (device->cpu_latency < 0)
+		return;
+
+	if (cpu_latency_qos_request_active(&device->qos))
+		cpu_latency_qos_update_request(&device->qos,
+					       device->cpu_latency);
+	else
+		cpu_latency_qos_add_request(&device->qos, device->cpu_latency);
+}
+
+static void release_cpu_latency(struct hc_sr04 *device)
+{
+	if (device->ext_line == NULL &&
+	    cpu_latency_qos_request_active(&device->qos))
+		cpu_latency_qos_update_request(&device->qos,
+					       PM_QOS_DEFAULT_VALUE);
+}
+
+/* measurement_mutex must be held by caller. */
+
+static int do_ping(struct hc_sr04 *device, struct hc_sr04_sample *sample)
+{
+	long long wait;
+	int ret;
+
+	if (device->ext_line != NULL)
+		return -EBUSY;
+		/* pinged by the external trigger only */
+
+	if (device->health == HEALTH_FAILED &&
+	    time_before(jiffies, device->retry_at))
+		return -EAGAIN;
+		/* quarantined sensors don't get airtime until their
+		 * next retry is due.
+		 */
+
+	wait = device->ping_gap + get_random_u32() % GHOST_DITHER_USECS;
+	if (device->time_burst != 0)
+		wait -= usecs_between(device->time_burst, ktime_get());
+	if (wait > 0)
+		usleep_range(wait, wait + 100);
+		/* wait ping_gap usecs (60 ms by default) between
+		 * measurements. now, a while true ; do cat measure ; done
+		 * should work
+		 */
+
+	if (device->serdev != NULL)
+		return serial_ping(device, sample);
+
+	if (READ_ONCE(device->echo_tail))
+		wait_event_timeout(device->wait_for_echo,
+				   !READ_ONCE(device->echo_tail) ||
+				   !gpio_get_value(device->gpio_echo),
+				   usecs_to_jiffies(MAX_ECHO_USECS));
+		/* the last echo ended after its reader was released,
+		 * the sensor ignores triggers until then.
+		 */
+
+	ret = wait_for_echo_low(device);
+	if (ret < 0) {
+		update_health(device, ret, 0);
+		return ret;
+	}
+
+	hold_cpu_latency(device);
+		/* not while waiting for a stuck echo, that may take a
+		 * power cycle.
+		 */
+	trigger_sensor(device);
+	ret = finish_ping(device, sample);
+	release_cpu_latency(device);
+
+	return ret;
+}
+
+/* measurement_mutex must be held by caller. Wakes the sensor up if it
+ * was idle.
+ */
+
+static int ping_sensor(struct hc_sr04 *device, struct hc_sr04_sample *sample)
+{
+	int ret;
+
+	if (READ_ONCE(device->suspended))
+		return -EAGAIN;
+
+	ret = pm_runtime_get_sync(device->dev);
+	if (ret < 0) {
+		pm_runtime_put_noidle(device->dev);
+		return ret;
+	}
+
+	ret = do_ping(device, sample);
+
+	pm_runtime_mark_last_busy(device->dev);
+	pm_runtime_put_autosuspend(device->dev);
+
+	return ret;
+}
+
+/* On-demand pings go through a fair queue: the clients with pending
+ * pings take turns round robin, each at most client_rate times per
+ * second and all of them together at most ondemand_cap times per second.
+ * Stream pings and bursts are not affected.
+ */
+
+static int client_pending(const struct hc_sr04_client *client)
+{
+	if (client->reader != NULL)
+		return client->reader->arm_seq != client->reader->start_seq;
+	return client->pending != 0;
+}
+
+/* sensor->lock must be held. Returns the client whose turn it is or NULL,
+ * in which case *when is when a rate limited client may go next.
+ */
+static struct hc_sr04_client *fq_next(struct hc_sr04 *sensor, ktime_t now,
+				      ktime_t *when)
+{
+	struct hc_sr04_client *client;
+	ktime_t start;
+
+	*when = KTIME_MAX;
+	if (sensor->ondemand_owner != NULL)
+		return NULL;
+
+	list_for_each_entry(client, &sensor->clients, list) {
+		if (!client_pending(client))
+			continue;
+		start = client->next_ping;
+		if (ktime_before(start, sensor->ondemand_next))
+			start = sensor->ondemand_next;
+		if (ktime_after(start, now)) {
+			*when = min(*when, start);
+			continue;
+		}
+		return client;
+	}
+	return NULL;
+}
+
+/* sensor->lock must be held. Readers' pings are done by the ping work,
+ * sysfs readers wait on their client's queue, one of them is woken.
+ */
+static void fq_kick(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_client *next;
+	ktime_t now, when;
+
+	if (sensor->removed)
+		return;
+
+	now = ktime_get();
+	next = fq_next(sensor, now, &when);
+	if (next != NULL && next->reader != NULL)
+		mod_delayed_work(system_wq, &sensor->ping_work, 0);
+	else if (when != KTIME_MAX)
+		mod_delayed_work(system_wq, &sensor->ping_work,
+				 usecs_to_jiffies(ktime_us_delta(when, now)));
+	if (next != NULL && next->reader == NULL)
+		wake_up(&next->wait);
+}
+
+/* sensor->lock must be held. */
+static void fq_grant(struct hc_sr04 *sensor, struct hc_sr04_client *client,
+		     ktime_t now)
+{
+	sensor->ondemand_owner = client;
+	list_move_tail(&client->list, &sensor->clients);
+	if (sensor->client_rate != 0)
+		client->next_ping = ktime_add_ns(now,
+			div_u64(NSEC_PER_SEC, sensor->client_rate));
+	if (sensor->ondemand_cap != 0)
+		sensor->ondemand_next = ktime_add_ns(now,
+			div_u64(NSEC_PER_SEC, sensor->ondemand_cap));
+}
+
+/* sensor->lock must be held. */
+static void fq_release(struct hc_sr04 *sensor)
+{
+	sensor->ondemand_owner = NULL;
+	fq_kick(sensor);
+}
+
+/* Queues a sysfs read of the current user. Users beyond MAX_UID_CLIENTS
+ * take over the slot of an idle user.
+ */
+static struct hc_sr04_client *fq_enter(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_client *client;
+	kuid_t uid = current_uid();
+	ktime_t now;
+
+	now = ktime_get();
+	spin_lock(&sensor->lock);
+	list_for_each_entry(client, &sensor->clients, list)
+		if (client->reader == NULL && uid_eq(client->uid, uid))
+			goto found;
+
+	if (sensor->nr_uid_clients < MAX_UID_CLIENTS) {
+		client = &sensor->uid_clients[sensor->nr_uid_clients++];
+		client->uid = uid;
+		list_add_tail(&client->list, &sensor->clients);
+		goto found;
+	}
+	list_for_each_entry(client, &sensor->clients, list) {
+		if (client->reader == NULL && client->pending == 0 &&
+		    client != sensor->ondemand_owner &&
+		    !ktime_after(client->next_ping, now)) {
+			client->uid = uid;
+			goto found;
+		}
+	}
+	spin_unlock(&sensor->lock);
+	return ERR_PTR(-EBUSY);
+
+found:
+	client->pending++;
+	fq_kick(sensor);
+	spin_unlock(&sensor->lock);
+
+	return client;
+}
+
+/* Returns true once it is the client's turn (which it then takes) or the
+ * sensor is going away.
+ */
+static int fq_try_claim(struct hc_sr04 *sensor, struct hc_sr04_client *client)
+{
+	ktime_t now, when;
+	int ret;
+
+	now = ktime_get();
+	spin_lock(&sensor->lock);
+	ret = sensor->removed;
+	if (!ret && fq_next(sensor, now, &when) == client) {
+		fq_grant(sensor, client, now);
+		client->pending--;
+		ret = 1;
+	}
+	spin_unlock(&sensor->lock);
+
+	return ret;
+}
+
+/* Takes measurement_mutex if it is free and the sensor is not being
+ * removed. Never waits, and sysfs handlers must not take devices_mutex:
+ * remove_sensor() holds it while it drains them.
+ */
+
+static int claim_sensor(struct hc_sr04 *device)
+{
+	if (!mutex_trylock(&device->measurement_mutex))
+		return -EBUSY;
+	if (READ_ONCE(device->removed)) {
+		mutex_unlock(&device->measurement_mutex);
+		return -ENODEV;
+	}
+
+	return 0;
+}
+
+/* The caller keeps the device alive. Does not take devices_mutex, so
+ * that removing a sensor or a frontend may drain sysfs readers while
+ * holding it. Waits for the turn of the current user in the fair queue.
+ */
+static int do_measurement(struct hc_sr04 *device,
+			  struct hc_sr04_sample *sample)
+{
+	struct hc_sr04_client *client;
+	int ret;
+
+	kref_get(&device->ref);
+
+	client = fq_enter(device);
+	if (IS_ERR(client)) {
+		ret = PTR_ERR(client);
+		goto out;
+	}
+
+	ret = wait_event_interruptible_exclusive(client->wait,
+						 fq_try_claim(device, client));
+	spin_lock(&device->lock);
+	if (device->ondemand_owner != client) {
+		client->pending--;
+		fq_kick(device);
+		spin_unlock(&device->lock);
+		if (ret == 0)
+			ret = -ENODEV;
+		goto out;
+	}
+	spin_unlock(&device->lock);
+
+	mutex_lock(&device->measurement_mutex);
+	if (READ_ONCE(device->removed))
+		ret = -ENODEV;
+	else
+		ret = ping_sensor(device, sample);
+	mutex_unlock(&device->measurement_mutex);
+
+	spin_lock(&device->lock);
+	fq_release(device);
+	spin_unlock(&device->lock);
+out:
+	kref_put(&device->ref, free_hc_sr04);
+	return ret;
+}
+
+static int cmp_usecs(const void *a, const void *b)
+{
+	const long long *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* Sorts usecs. */
+static void compute_stats(long long *usecs, int n, struct hc_sr04_stats *stats)
+{
+	long long sum, sum_sq;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (n == 0)
+		return;
+
+	sort(usecs, n, sizeof(*usecs), cmp_usecs, NULL);
+
+	sum = 0;
+	sum_sq = 0;
+	for (i = 0; i < n; i++) {
+		sum += usecs[i];
+		sum_sq += usecs[i] * usecs[i];
+	}
+	stats->valid = n;
+	stats->min = usecs[0];
+	stats->median = n % 2 ? usecs[n / 2] :
+				(usecs[n / 2 - 1] + usecs[n / 2]) / 2;
+	stats->mean = div_s64(sum, n);
+	stats->stddev = int_sqrt64(div_s64(sum_sq - div_s64(sum * sum, n), n));
+}
+
+/* Back to back pings at the current ping gap. Samples that timed out or
+ * are flagged are left out of the statistics. measurement_mutex must be
+ * held by caller.
+ */
+
+static int do_burst(struct hc_sr04 *device, int count,
+		    struct hc_sr04_stats *stats)
+{
+	long long usecs[MAX_BURST_COUNT];
+	struct hc_sr04_sample sample;
+	int i, n, err;
+
+	n = 0;
+	for (i = 0; i < count; i++) {
+		err = ping_sensor(device, &sample);
+		if (err == -ETIMEDOUT || err == -EIO || err == -ERANGE)
+			continue;
+		if (err < 0)
+			return err;
+		if (sample.flags != 0)
+			continue;
+		usecs[n++] = sample.usecs;
+	}
+	compute_stats(usecs, n, stats);
+
+	return n > 0 ? 0 : -ENODATA;
+}
+
+/* Self characterization: shorten the gap step by step until ghosts,
+ * timeouts or a spread of the readings beyond what we saw at the safe
+ * default gap show up, and settle on the last gap that was fine.
+ * Expects a static scene. measurement_mutex must be held by caller.
+ */
+
+static int autotune_gap(struct hc_sr04 *device)
+{
+	struct hc_sr04_sample sample;
+	struct hc_sr04_stats stats;
+	unsigned long gap, good_gap;
+	long long usecs[AUTOTUNE_PINGS];
+	long long max_stddev;
+	int i, valid, bad, err;
+
+	device->tuned_gap = 0;
+	good_gap = 0;
+	max_stddev = 0;
+
+	for (gap = PING_GAP_USECS; gap >= MIN_PING_GAP_USECS;
+	     gap = gap * 4 / 5) {
+		device->ping_gap = gap;
+		valid = 0;
+		bad = 0;
+
+		for (i = 0; i < AUTOTUNE_PINGS; i++) {
+			err = ping_sensor(device, &sample);
+			if (err == -ETIMEDOUT ||
+			    (err == 0 && (sample.flags & HC_SR04_SAMPLE_GHOST))) {
+				bad++;
+				continue;
+			}
+			if (err < 0)
+				goto out;
+			usecs[valid++] = sample.usecs;
+		}
+		if (bad > 0 || valid < 2)
+			break;
+
+		compute_stats(usecs, valid, &stats);
+		if (good_gap == 0)
+			max_stddev = 2 * stats.stddev + GHOST_TOLERANCE_USECS;
+		else if (stats.stddev > max_stddev)
+			break;
+
+		good_gap = gap;
+	}
+	err = good_gap ? 0 : -EIO;
+
+out:
+	if (good_gap) {
+		device->ping_gap = good_gap;
+		device->tuned_gap = good_gap;
+	} else {
+		device->ping_gap = PING_GAP_USECS;
+	}
+	device->window_pings = 0;
+	device->window_ghosts = 0;
+
+	return err;
+}
+
+/* The measure and sample files live in hc-sr04-sysfs.ko. The caller keeps
+ * the sensor alive (e.g. by an active sysfs file), like a sysfs show does.
+ */
+int hc_sr04_measure(struct hc_sr04 *sensor, struct hc_sr04_sample *sample)
+{
+	return do_measurement(sensor, sample);
+}
+EXPORT_SYMBOL_GPL(hc_sr04_measure);
+
+const char *hc_sr04_name(struct hc_sr04 *sensor)
+{
+	return dev_name(sensor->dev);
+}
+EXPORT_SYMBOL_GPL(hc_sr04_name);
+
+/* Fills snap for the index-th sensor without pinging it. Returns -ENOENT
+ * past the last sensor.
+ */
+int hc_sr04_snapshot(int index, struct hc_sr04_snapshot *snap)
+{
+	struct hc_sr04 *sensor;
+
+	mutex_lock(&devices_mutex);
+	list_for_each_entry(sensor, &hc_sr04_devices, list) {
+		if (index-- > 0)
+			continue;
+
+		strscpy(snap->name, dev_name(sensor->dev), sizeof(snap->name));
+		spin_lock(&sensor->lock);
+		snap->pings = sensor->pings;
+		snap->have_last = sensor->have_last;
+		snap->last = sensor->last;
+		spin_unlock(&sensor->lock);
+		snap->timeouts = sensor->timeouts;
+		snap->glitches = sensor->glitches;
+		snap->stuck_echoes = sensor->stuck_echoes;
+		snap->power_cycles = sensor->power_cycles;
+		snap->missed_deadlines = sensor->missed_deadlines;
+		snap->ext_missed = sensor->ext_missed;
+		snap->health = sensor->health;
+		mutex_unlock(&devices_mutex);
+		return 0;
+	}
+	mutex_unlock(&devices_mutex);
+	return -ENOENT;
+}
+EXPORT_SYMBOL_GPL(hc_sr04_snapshot);
+
+static ssize_t min_pulse_width_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->min_pulse_width);
+}
+
+static ssize_t min_pulse_width_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned long usecs;
+	int err;
+
+	err = kstrtoul(buf, 10, &usecs);
+	if (err < 0)
+		return err;
+
+	sensor->min_pulse_width = usecs;
+	return len;
+}
+
+static DEVICE_ATTR_RW(min_pulse_width);
+
+static ssize_t multi_edge_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", sensor->multi_edge);
+}
+
+static ssize_t multi_edge_store(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	bool on;
+	int err;
+
+	err = kstrtobool(buf, &on);
+	if (err < 0)
+		return err;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->multi_edge = on;
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(multi_edge);
+
+static void disable_ext_trigger(struct hc_sr04 *sensor);
+static int enable_ext_trigger(struct hc_sr04 *sensor, int gpio);
+
+static ssize_t ext_trigger_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int gpio;
+
+	mutex_lock(&sensor->measurement_mutex);
+	gpio = sensor->ext_line != NULL ? sensor->ext_line->gpio : -1;
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return sprintf(buf, "%d\n", gpio);
+}
+
+static ssize_t ext_trigger_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int gpio;
+	int err;
+
+	err = kstrtoint(buf, 10, &gpio);
+	if (err < 0)
+		return err;
+	if (gpio >= 0 && (!gpio_is_valid(gpio) || gpio == sensor->gpio_trig ||
+			  gpio == sensor->gpio_echo))
+		return -EINVAL;
+	if (sensor->serdev != NULL)
+		return -EOPNOTSUPP;
+	if (gpio >= 0 && (gpio_cansleep(sensor->gpio_trig) ||
+			  gpio_cansleep(sensor->gpio_echo)))
+		return -EOPNOTSUPP;
+		/* the trigger pulse is sent from hard IRQ context */
+
+	mutex_lock(&sensor->measurement_mutex);
+	if (READ_ONCE(sensor->removed)) {
+		mutex_unlock(&sensor->measurement_mutex);
+		return -ENODEV;
+	}
+	disable_ext_trigger(sensor);
+	if (gpio >= 0)
+		err = enable_ext_trigger(sensor, gpio);
+	mutex_unlock(&sensor->measurement_mutex);
+	kick_scheduler();
+
+	if (err < 0)
+		return err;
+	return len;
+}
+
+static DEVICE_ATTR_RW(ext_trigger);
+
+static ssize_t ext_missed_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->ext_missed);
+}
+
+static DEVICE_ATTR_RO(ext_missed);
+
+static DEFINE_MUTEX(membership_mutex);
+		/* protects hc_sr04_groups while sensors join and leave,
+		 * taken after measurement_mutex and before groups_mutex */
+static DEFINE_MUTEX(groups_mutex);
+		/* protects group membership as seen from pings and the
+		 * nearest values */
+
+static int join_group(struct hc_sr04 *sensor, const char *name);
+static void leave_group(struct hc_sr04 *sensor);
+
+static ssize_t group_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int len;
+
+	mutex_lock(&groups_mutex);
+	len = sprintf(buf, "%s\n",
+		      sensor->group != NULL ? sensor->group->name : "");
+	mutex_unlock(&groups_mutex);
+
+	return len;
+}
+
+static ssize_t group_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	char copy[GROUP_NAME_LEN];
+	char *name;
+	int i, err;
+
+	if (strscpy(copy, buf, sizeof(copy)) < 0)
+		return -EINVAL;
+	name = strim(copy);
+	for (i = 0; name[i] != '\0'; i++)
+		if (!isalnum(name[i]) && name[i] != '_' && name[i] != '-')
+			return -EINVAL;
+
+	err = 0;
+	mutex_lock(&membership_mutex);
+	if (READ_ONCE(sensor->removed)) {
+		mutex_unlock(&membership_mutex);
+		return -ENODEV;
+	}
+	leave_group(sensor);
+	if (name[0] != '\0')
+		err = join_group(sensor, name);
+	mutex_unlock(&membership_mutex);
+
+	if (err < 0)
+		return err;
+	return len;
+}
+
+static DEVICE_ATTR_RW(group);
+
+static ssize_t glitches_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->glitches);
+}
+
+static DEVICE_ATTR_RO(glitches);
+
+static ssize_t health_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", health_names[sensor->health]);
+}
+
+static DEVICE_ATTR_RO(health);
+
+static ssize_t timeouts_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->timeouts);
+}
+
+static DEVICE_ATTR_RO(timeouts);
+
+static ssize_t no_echo_starts_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->no_echo_starts);
+}
+
+static DEVICE_ATTR_RO(no_echo_starts);
+
+static ssize_t stuck_echoes_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->stuck_echoes);
+}
+
+static DEVICE_ATTR_RO(stuck_echoes);
+
+static ssize_t power_cycles_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->power_cycles);
+}
+
+static DEVICE_ATTR_RO(power_cycles);
+
+static ssize_t ping_gap_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->ping_gap);
+}
+
+static ssize_t ping_gap_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned long usecs;
+	int err;
+
+	err = kstrtoul(buf, 10, &usecs);
+	if (err < 0)
+		return err;
+	if (usecs < MIN_PING_GAP_USECS)
+		return -EINVAL;
+
+	sensor->tuned_gap = 0;
+	sensor->ping_gap = usecs;
+	return len;
+}
+
+static DEVICE_ATTR_RW(ping_gap);
+
+static ssize_t autotune_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->tuned_gap);
+}
+
+static ssize_t autotune_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	bool enable;
+	int err;
+
+	err = kstrtobool(buf, &enable);
+	if (err < 0)
+		return err;
+
+	if (!enable) {
+		sensor->tuned_gap = 0;
+		return len;
+	}
+
+	err = claim_sensor(sensor);
+	if (err < 0)
+		return err;
+
+	err = autotune_gap(sensor);
+	mutex_unlock(&sensor->measurement_mutex);
+
+	if (err < 0)
+		return err;
+	return len;
+}
+
+static DEVICE_ATTR_RW(autotune);
+
+static ssize_t burst_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_stats stats;
+	int err;
+
+	err = claim_sensor(sensor);
+	if (err < 0)
+		return err;
+
+	err = do_burst(sensor, sensor->burst_count, &stats);
+	mutex_unlock(&sensor->measurement_mutex);
+
+	if (err < 0)
+		return err;
+
+	return sprintf(buf, "%lld %lld %lld %lld %d\n", stats.min,
+		       stats.median, stats.mean, stats.stddev, stats.valid);
+}
+
+static ssize_t burst_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int count;
+	int err;
+
+	err = kstrtoint(buf, 10, &count);
+	if (err < 0)
+		return err;
+	if (count < 1 || count > MAX_BURST_COUNT)
+		return -EINVAL;
+
+	sensor->burst_count = count;
+	return len;
+}
+
+static DEVICE_ATTR_RW(burst);
+
+static ssize_t offset_show(struct device *dev,
+			   struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	long long offset;
+
+	mutex_lock(&sensor->measurement_mutex);
+	offset = sensor->offset;
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return sprintf(buf, "%lld\n", offset);
+}
+
+static ssize_t offset_store(struct device *dev,
+			    struct device_attribute *attr,
+			    const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	long long offset;
+	int err;
+
+	err = kstrtoll(buf, 10, &offset);
+	if (err < 0)
+		return err;
+	if (offset < -MAX_ECHO_USECS || offset > MAX_ECHO_USECS)
+		return -EINVAL;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->offset = offset;
+	mutex_unlock(&sensor->measurement_mutex);
+	return len;
+}
+
+static DEVICE_ATTR_RW(offset);
+
+/* The sensor has to face a flat target mm away. The burst runs with the
+ * offset at 0, so its median is the raw echo length, and the difference
+ * to the one expected for that distance becomes the new offset. On
+ * failure the old offset stays.
+ */
+static ssize_t calibrate_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_stats stats;
+	long long old_offset;
+	unsigned int mm;
+	int err;
+
+	err = kstrtouint(buf, 10, &mm);
+	if (err < 0)
+		return err;
+	if (mm == 0 || mm > MAX_CALIBRATION_MM)
+		return -EINVAL;
+
+	err = claim_sensor(sensor);
+	if (err < 0)
+		return err;
+
+	old_offset = sensor->offset;
+	sensor->offset = 0;
+		/* with the offset subtracted, readings below it would be
+		 * clamped to 0 and the median could not converge.
+		 */
+	err = do_burst(sensor, CALIBRATION_PINGS, &stats);
+	if (err == 0 && stats.valid < CALIBRATION_PINGS / 2)
+		err = -EIO;
+	if (err == 0) {
+		sensor->offset = stats.median - MM_TO_USECS(mm);
+		pr_info("hc-sr04: %s: offset %lld usecs (%d samples at %u mm)\n",
+			dev_name(dev), sensor->offset, stats.valid, mm);
+	} else {
+		sensor->offset = old_offset;
+	}
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return err < 0 ? err : len;
+}
+
+static DEVICE_ATTR_WO(calibrate);
+
+static ssize_t echo_delay_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	long long delay = -1;
+
+	spin_lock(&sensor->lock);
+	if (sensor->have_last)
+		delay = sensor->last.echo_delay;
+	spin_unlock(&sensor->lock);
+
+	return sprintf(buf, "%lld\n", delay);
+}
+
+static DEVICE_ATTR_RO(echo_delay);
+
+static ssize_t confidence_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int confidence = -1;
+
+	spin_lock(&sensor->lock);
+	if (sensor->have_last)
+		confidence = sensor->last.confidence;
+	spin_unlock(&sensor->lock);
+
+	return sprintf(buf, "%d\n", confidence);
+}
+
+static DEVICE_ATTR_RO(confidence);
+
+static ssize_t clock_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%s\n", stamp_names[sensor->stamp_clock]);
+}
+
+/* History and rollups are cleared, their periods and deltas would not
+ * make sense across clocks (rollup_add() only moves forward in time).
+ */
+static ssize_t clock_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_history *h = &sensor->history;
+	int clock, i;
+	size_t size;
+	u8 *hist_buf;
+
+	clock = sysfs_match_string(stamp_names, buf);
+	if (clock < 0)
+		return clock;
+
+	mutex_lock(&sensor->measurement_mutex);
+	if (clock == sensor->stamp_clock) {
+		mutex_unlock(&sensor->measurement_mutex);
+		return len;
+	}
+	WRITE_ONCE(sensor->stamp_clock, clock);
+
+	mutex_lock(&sensor->history_mutex);
+	hist_buf = h->buf;
+	size = h->size;
+	memset(h, 0, sizeof(*h));
+	h->buf = hist_buf;
+	h->size = size;
+	mutex_unlock(&sensor->history_mutex);
+
+	mutex_lock(&sensor->rollup_mutex);
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		sensor->tiers[i].cur = 0;
+		memset(sensor->tiers[i].buckets, 0,
+		       sizeof(sensor->tiers[i].buckets));
+	}
+	mutex_unlock(&sensor->rollup_mutex);
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(clock);
+
+static ssize_t cpu_latency_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", sensor->cpu_latency);
+}
+
+static ssize_t cpu_latency_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int latency;
+	int err;
+
+	err = kstrtoint(buf, 10, &latency);
+	if (err < 0)
+		return err;
+	if (latency < -1)
+		return -EINVAL;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->cpu_latency = latency;
+	if (sensor->ext_line != NULL) {
+		if (latency < 0 &&
+		    cpu_latency_qos_request_active(&sensor->qos))
+			cpu_latency_qos_update_request(&sensor->qos,
+						       PM_QOS_DEFAULT_VALUE);
+		else
+			hold_cpu_latency(sensor);
+	}
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(cpu_latency);
+
+static ssize_t range_show(struct device *dev,
+			  struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u %u\n", sensor->range_min_mm,
+		       sensor->range_max_mm);
+}
+
+static ssize_t range_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned int min_mm, max_mm;
+
+	if (sscanf(buf, "%u %u", &min_mm, &max_mm) != 2)
+		return -EINVAL;
+	if (max_mm != 0 && min_mm > max_mm)
+		return -EINVAL;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->range_min_mm = min_mm;
+	sensor->range_max_mm = max_mm;
+	sensor->range_min = MM_TO_USECS(min_mm);
+	sensor->range_max = MM_TO_USECS(max_mm);
+	mutex_unlock(&sensor->measurement_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(range);
+
+static ssize_t rate_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sensor->rate);
+}
+
+static ssize_t rate_store(struct device *dev,
+			  struct device_attribute *attr,
+			  const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned int rate;
+	int err;
+
+	err = kstrtouint(buf, 10, &rate);
+	if (err < 0)
+		return err;
+	if (rate > MAX_RATE)
+		return -EINVAL;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->rate = rate;
+	sensor->release = ktime_get();
+	sensor->deadline = sensor->release;
+	mutex_unlock(&sensor->measurement_mutex);
+	kick_scheduler();
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(rate);
+
+static ssize_t priority_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", sensor->priority);
+}
+
+static ssize_t priority_store(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	int priority;
+	int err;
+
+	err = kstrtoint(buf, 10, &priority);
+	if (err < 0)
+		return err;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->priority = priority;
+	mutex_unlock(&sensor->measurement_mutex);
+	kick_scheduler();
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(priority);
+
+static ssize_t missed_deadlines_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%lu\n", sensor->missed_deadlines);
+}
+
+static DEVICE_ATTR_RO(missed_deadlines);
+
+static ssize_t ondemand_cap_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sensor->ondemand_cap);
+}
+
+static ssize_t ondemand_cap_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned int rate;
+	int err;
+
+	err = kstrtouint(buf, 10, &rate);
+	if (err < 0)
+		return err;
+	if (rate > MAX_RATE)
+		return -EINVAL;
+
+	spin_lock(&sensor->lock);
+	sensor->ondemand_cap = rate;
+	sensor->ondemand_next = 0;
+	fq_kick(sensor);
+	spin_unlock(&sensor->lock);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(ondemand_cap);
+
+static ssize_t client_rate_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", sensor->client_rate);
+}
+
+static ssize_t client_rate_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	struct hc_sr04_client *client;
+	unsigned int rate;
+	int err;
+
+	err = kstrtouint(buf, 10, &rate);
+	if (err < 0)
+		return err;
+	if (rate > MAX_RATE)
+		return -EINVAL;
+
+	spin_lock(&sensor->lock);
+	sensor->client_rate = rate;
+	list_for_each_entry(client, &sensor->clients, list)
+		client->next_ping = 0;
+	fq_kick(sensor);
+	spin_unlock(&sensor->lock);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(client_rate);
+
+static ssize_t adaptive_rate_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	if (sensor->min_rate == 0)
+		return sprintf(buf, "0\n");
+
+	return sprintf(buf, "%u %u %lu %u\n", sensor->min_rate,
+		       sensor->max_rate, sensor->tolerance, sensor->cur_rate);
+}
+
+static ssize_t adaptive_rate_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned int min_rate, max_rate;
+	unsigned long tolerance;
+	int n;
+
+	min_rate = 0;
+	max_rate = 0;
+	tolerance = 0;
+	n = sscanf(buf, "%u %u %lu", &min_rate, &max_rate, &tolerance);
+	if (n < 1 || (min_rate != 0 && n != 3))
+		return -EINVAL;
+	if (min_rate > max_rate || max_rate > MAX_RATE)
+		return -EINVAL;
+
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->min_rate = min_rate;
+	sensor->max_rate = max_rate;
+	sensor->cur_rate = max_rate;
+	sensor->tolerance = tolerance;
+	sensor->stable_count = 0;
+	sensor->release = ktime_get();
+	sensor->deadline = sensor->release;
+	mutex_unlock(&sensor->measurement_mutex);
+	kick_scheduler();
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(adaptive_rate);
+
+static ssize_t history_size_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%zu\n", sensor->history.size);
+}
+
+static ssize_t history_size_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(dev);
+	unsigned long size;
+	u8 *new_buf;
+	int err;
+
+	err = kstrtoul(buf, 10, &size);
+	if (err < 0)
+		return err;
+	if (size > MAX_HISTORY_SIZE ||
+	    (size != 0 && size < HISTORY_RECORD_MAX))
+		return -EINVAL;
+
+	new_buf = NULL;
+	if (size != 0) {
+		new_buf = kvmalloc(size, GFP_KERNEL);
+		if (new_buf == NULL)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&sensor->history_mutex);
+	kvfree(sensor->history.buf);
+	memset(&sensor->history, 0, sizeof(sensor->history));
+	sensor->history.buf = new_buf;
+	sensor->history.size = size;
+	mutex_unlock(&sensor->history_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RW(history_size);
+
+static ssize_t history_read_records(struct file *filp, struct kobject *kobj,
+				    struct bin_attribute *attr, char *buf,
+				    loff_t off, size_t count)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(kobj_to_dev(kobj));
+	int n;
+
+	if (off % sizeof(struct hc_sr04_record))
+		return -EINVAL;
+
+	mutex_lock(&sensor->history_mutex);
+	n = history_read(&sensor->history,
+			 div_u64(off, sizeof(struct hc_sr04_record)),
+			 (struct hc_sr04_record *) buf,
+			 count / sizeof(struct hc_sr04_record));
+	mutex_unlock(&sensor->history_mutex);
+
+	if (n < 0)
+		return n;
+	return n * sizeof(struct hc_sr04_record);
+}
+
+static BIN_ATTR(history, 0444, history_read_records, NULL, 0);
+
+/* Returns all buckets of all tiers at once, one second tier first, each
+ * oldest first. Buckets without samples have count and errors 0.
+ */
+static ssize_t rollups_read(struct file *filp, struct kobject *kobj,
+			    struct bin_attribute *attr, char *buf,
+			    loff_t off, size_t count)
+{
+	struct hc_sr04 *sensor = dev_get_drvdata(kobj_to_dev(kobj));
+	struct hc_sr04_rollup *rollups;
+	struct hc_sr04_tier *tier;
+	struct hc_sr04_bucket *b;
+	int i, j, n;
+
+	rollups = kcalloc(ROLLUP_TIERS * ROLLUP_BUCKETS, sizeof(*rollups),
+			  GFP_KERNEL);
+	if (rollups == NULL)
+		return -ENOMEM;
+
+	n = 0;
+	mutex_lock(&sensor->rollup_mutex);
+	for (i = 0; i < ROLLUP_TIERS; i++) {
+		tier = &sensor->tiers[i];
+		for (j = 1; j <= ROLLUP_BUCKETS; j++, n++) {
+			b = &tier->buckets[(tier->cur + j) % ROLLUP_BUCKETS];
+			rollups[n].period_secs = tier->secs;
+			if (b->count + b->errors == 0)
+				continue;
+			rollups[n].start_ns = b->period * tier->secs *
+					      NSEC_PER_SEC;
+			rollups[n].count = b->count;
+			rollups[n].errors = b->errors;
+			rollups[n].min = b->min;
+			rollups[n].max = b->max;
+			if (b->count)
+				rollups[n].mean = div_u64(b->sum, b->count);
+		}
+	}
+	mutex_unlock(&sensor->rollup_mutex);
+
+	memcpy(buf, (char *) rollups + off, count);
+	kfree(rollups);
+
+	return count;
+}
+
+static BIN_ATTR(rollups, 0444, rollups_read, NULL,
+		ROLLUP_TIERS * ROLLUP_BUCKETS * sizeof(struct hc_sr04_rollup));
+
+static struct bin_attribute *sensor_bin_attrs[] = {
+	&bin_attr_history,
+	&bin_attr_rollups,
+	NULL,
+};
+
+static struct attribute *sensor_attrs[] = {
+	&dev_attr_min_pulse_width.attr,
+	&dev_attr_offset.attr,
+	&dev_attr_calibrate.attr,
+	&dev_attr_echo_delay.attr,
+	&dev_attr_confidence.attr,
+	&dev_attr_clock.attr,
+	&dev_attr_cpu_latency.attr,
+	&dev_attr_range.attr,
+	&dev_attr_multi_edge.attr,
+	&dev_attr_ext_trigger.attr,
+	&dev_attr_ext_missed.attr,
+	&dev_attr_group.attr,
+	&dev_attr_glitches.attr,
+	&dev_attr_health.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_no_echo_starts.attr,
+	&dev_attr_stuck_echoes.attr,
+	&dev_attr_power_cycles.attr,
+	&dev_attr_ping_gap.attr,
+	&dev_attr_autotune.attr,
+	&dev_attr_burst.attr,
+	&dev_attr_rate.attr,
+	&dev_attr_priority.attr,
+	&dev_attr_missed_deadlines.attr,
+	&dev_attr_adaptive_rate.attr,
+	&dev_attr_ondemand_cap.attr,
+	&dev_attr_client_rate.attr,
+	&dev_attr_history_size.attr,
+	NULL,
+};
+
+static const struct attribute_group sensor_group = {
+	.attrs = sensor_attrs,
+	.bin_attrs = sensor_bin_attrs,
+};
+
+static const struct attribute_group *sensor_groups[] = {
+	&sensor_group,
+	NULL
+};
+
+static void fill_record(struct hc_sr04_record *record, int err,
+			const struct hc_sr04_sample *sample)
+{
+	record->status = err;
+	if (err < 0 && err != -ERANGE) {
+		record->timestamp_ns = 0;
+		record->usecs = 0;
+		record->flags = 0;
+		return;
+	}
+	record->timestamp_ns = timespec64_to_ns(&sample->timestamp);
+	record->usecs = sample->usecs;
+	record->flags = sample->flags;
+}
+
+static void free_reader(struct kref *ref)
+{
+	struct hc_sr04_reader *reader;
+
+	reader = container_of(ref, struct hc_sr04_reader, ref);
+	hrtimer_cancel(&reader->age_timer);
+	kref_put(&reader->sensor->ref, free_hc_sr04);
+	kfree(reader);
+}
+
+static enum hrtimer_restart reader_aged(struct hrtimer *timer)
+{
+	struct hc_sr04_reader *reader;
+
+	reader = container_of(timer, struct hc_sr04_reader, age_timer);
+	reader->aged = 1;
+	wake_up_interruptible(&reader->wait);
+
+	return HRTIMER_NORESTART;
+}
+
+static int reader_ready(struct hc_sr04_reader *reader)
+{
+	return kfifo_len(&reader->results) >= reader->wm_samples ||
+	       (reader->aged && !kfifo_is_empty(&reader->results)) ||
+	       READ_ONCE(reader->sensor->removed);
+}
+
+/* sensor->lock must be held. Readers are only woken up once their
+ * watermark is reached, when the queue runs over the oldest result is
+ * dropped.
+ */
+static void queue_record(struct hc_sr04_reader *reader,
+			 const struct hc_sr04_record *record)
+{
+	if (kfifo_is_full(&reader->results))
+		kfifo_skip(&reader->results);
+	kfifo_put(&reader->results, *record);
+
+	if (kfifo_len(&reader->results) >= reader->wm_samples)
+		wake_up_interruptible(&reader->wait);
+	else if (kfifo_len(&reader->results) == 1 && reader->wm_usecs != 0)
+		hrtimer_start(&reader->age_timer,
+			      us_to_ktime(reader->wm_usecs), HRTIMER_MODE_REL);
+}
+
+/* Does the armed ping of the reader whose turn it is in the fair queue,
+ * or wakes up the sysfs reader whose turn it is. Stream pings are up to
+ * the scheduler.
+ */
+
+static void ping_work_fn(struct work_struct *work)
+{
+	struct hc_sr04 *sensor = container_of(to_delayed_work(work),
+					      struct hc_sr04, ping_work);
+	struct hc_sr04_client *client;
+	struct hc_sr04_reader *reader;
+	struct hc_sr04_sample sample;
+	struct hc_sr04_record record;
+	ktime_t now, when;
+	int err;
+
+	now = ktime_get();
+	spin_lock(&sensor->lock);
+	if (sensor->removed) {
+		spin_unlock(&sensor->lock);
+		return;
+	}
+	client = fq_next(sensor, now, &when);
+	if (client == NULL || client->reader == NULL) {
+		fq_kick(sensor);
+		spin_unlock(&sensor->lock);
+		return;
+	}
+	fq_grant(sensor, client, now);
+	reader = client->reader;
+	record.seq = ++reader->start_seq;
+	kref_get(&reader->ref);
+	spin_unlock(&sensor->lock);
+
+	mutex_lock(&sensor->measurement_mutex);
+	err = ping_sensor(sensor, &sample);
+	mutex_unlock(&sensor->measurement_mutex);
+
+	spin_lock(&sensor->lock);
+	fill_record(&record, err, &sample);
+	queue_record(reader, &record);
+	reader->done_seq = record.seq;
+	fq_release(sensor);
+	spin_unlock(&sensor->lock);
+
+	kref_put(&reader->ref, free_reader);
+}
+
+static unsigned int sched_rate(struct hc_sr04 *sensor)
+{
+	return sensor->min_rate != 0 ? sensor->cur_rate : sensor->rate;
+}
+
+/* Static scene: slow down step by step. Any change: back to full rate at
+ * once. Timeouts and flagged samples don't count either way.
+ */
+static void adapt_rate(struct hc_sr04 *sensor, int err,
+		       const struct hc_sr04_sample *sample)
+{
+	if (sensor->min_rate == 0 || err < 0 || sample->flags != 0)
+		return;
+
+	if (sensor->stable_count > 0 &&
+	    abs(sample->usecs - sensor->stable_base) <= sensor->tolerance) {
+		if (++sensor->stable_count > ADAPT_STABLE_SAMPLES) {
+			sensor->cur_rate = max(sensor->cur_rate / 2,
+					       sensor->min_rate);
+			sensor->stable_count = 1;
+		}
+		return;
+	}
+	if (sensor->stable_count > 0)
+		sensor->cur_rate = sensor->max_rate;
+	sensor->stable_base = sample->usecs;
+	sensor->stable_count = 1;
+}
+
+/* Earliest time the sensor may be pinged again without violating its
+ * ping gap or quarantine.
+ */
+static ktime_t earliest_ping(struct hc_sr04 *sensor, ktime_t now)
+{
+	long long wait;
+
+	wait = 0;
+	if (sensor->time_burst != 0)
+		wait = sensor->ping_gap -
+			usecs_between(sensor->time_burst, now);
+	if (sensor->health == HEALTH_FAILED &&
+	    time_before(jiffies, sensor->retry_at))
+		wait = max_t(long long, wait,
+			     jiffies_to_usecs(sensor->retry_at - jiffies));
+
+	return wait > 0 ? ktime_add_us(now, wait) : now;
+}
+
+/* A burst right after another sensor's would be flagged by
+ * crosstalk_suspected(), so wait until that one's echo window is over.
+ */
+static ktime_t after_other_bursts(struct hc_sr04 *sensor, ktime_t start)
+{
+	struct hc_sr04_burst *burst;
+	ktime_t end;
+	int i;
+
+	spin_lock_irq(&burst_log_lock);
+	for (i = 0; i < BURST_LOG_SIZE; i++) {
+		burst = &burst_log[i];
+		if (burst->sensor == NULL || burst->sensor == sensor)
+			continue;
+		end = ktime_add_us(burst->time, MAX_ECHO_USECS);
+		if (ktime_after(end, start))
+			start = end;
+	}
+	spin_unlock_irq(&burst_log_lock);
+
+	return start;
+}
+
+/* devices_mutex must be held. Returns the sensor to ping now or NULL, in
+ * which case *next is when to look again.
+ */
+static struct hc_sr04 *pick_next_sensor(ktime_t now, ktime_t *next)
+{
+	struct hc_sr04 *sensor, *best, *best_effort;
+	ktime_t start, first_release;
+
+	best = NULL;
+	best_effort = NULL;
+	first_release = KTIME_MAX;
+	*next = KTIME_MAX;
+
+	list_for_each_entry(sensor, &hc_sr04_devices, list) {
+		if (READ_ONCE(sensor->streamers) == 0 ||
+		    sensor->ext_line != NULL || sensor->serdev != NULL ||
+		    READ_ONCE(sensor->suspended))
+			continue;
+
+		start = earliest_ping(sensor, now);
+		if (sched_rate(sensor) != 0 &&
+		    ktime_before(start, sensor->release))
+			start = sensor->release;
+		start = after_other_bursts(sensor, start);
+		if (ktime_after(start, now)) {
+			*next = min(*next, start);
+			if (sched_rate(sensor) != 0)
+				first_release = min(first_release, start);
+			continue;
+		}
+
+		if (sched_rate(sensor) != 0) {
+			if (best == NULL ||
+			    ktime_before(sensor->deadline, best->deadline) ||
+			    (sensor->deadline == best->deadline &&
+			     sensor->priority > best->priority))
+				best = sensor;
+		} else {
+			if (best_effort == NULL ||
+			    sensor->priority > best_effort->priority ||
+			    (sensor->priority == best_effort->priority &&
+			     ktime_before(sensor->last_scheduled,
+					  best_effort->last_scheduled)))
+				best_effort = sensor;
+		}
+	}
+
+	if (best != NULL)
+		return best;
+	if (best_effort != NULL &&
+	    ktime_us_delta(first_release, now) >= PING_BUDGET_USECS)
+		return best_effort;
+	return NULL;
+}
+
+static void queue_stream_record(struct hc_sr04 *sensor, int err,
+				const struct hc_sr04_sample *sample)
+{
+	struct hc_sr04_reader *reader;
+	struct hc_sr04_record record;
+
+	spin_lock(&sensor->lock);
+	record.seq = ++sensor->stream_seq;
+	fill_record(&record, err, sample);
+	record.flags |= HC_SR04_SAMPLE_STREAM;
+	list_for_each_entry(reader, &sensor->readers, list)
+		if (reader->streaming)
+			queue_record(reader, &record);
+	spin_unlock(&sensor->lock);
+}
+
+/* Rate adaptation and deadline bookkeeping after a streamed ping, for
+ * the scheduler thread and the serial streams alike. measurement_mutex
+ * must be held by caller.
+ */
+static void stream_bookkeeping(struct hc_sr04 *sensor, int err,
+			       const struct hc_sr04_sample *sample)
+{
+	ktime_t done;
+	u64 period;
+
+	adapt_rate(sensor, err, sample);
+
+	done = ktime_get();
+	sensor->last_scheduled = done;
+	if (sched_rate(sensor) != 0) {
+		period = div_u64(NSEC_PER_SEC, sched_rate(sensor));
+		if (ktime_after(done, sensor->deadline))
+			sensor->missed_deadlines++;
+		sensor->release = ktime_add_ns(sensor->release, period);
+		if (ktime_before(sensor->release, done))
+			sensor->release = done;
+		sensor->deadline = ktime_add_ns(sensor->release, period);
+	}
+}
+
+/* measurement_mutex must be held by caller. */
+
+static void scheduled_ping(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_sample sample;
+	int err;
+
+	err = ping_sensor(sensor, &sample);
+	stream_bookkeeping(sensor, err, &sample);
+	if (err == -EAGAIN)
+		return;
+
+	queue_stream_record(sensor, err, &sample);
+}
+
+/* Serial sensors don't share the air time of the GPIO sensors. Each one
+ * streams from its own work, sending the next request as soon as the
+ * ping gap (and rate) allows, so all of them run at full speed.
+ */
+
+static void serial_stream_fn(struct work_struct *work)
+{
+	struct hc_sr04 *sensor = container_of(to_delayed_work(work),
+					      struct hc_sr04, serial_stream);
+	struct hc_sr04_sample sample;
+	unsigned long delay;
+	ktime_t release;
+	s64 wait;
+	int err;
+
+	mutex_lock(&sensor->measurement_mutex);
+	err = ping_sensor(sensor, &sample);
+	if (err != -EBUSY)
+		stream_bookkeeping(sensor, err, &sample);
+	release = sched_rate(sensor) != 0 ? sensor->release : 0;
+	mutex_unlock(&sensor->measurement_mutex);
+	if (err != -EAGAIN && err != -EBUSY)
+		queue_stream_record(sensor, err, &sample);
+
+	delay = 0;
+	if (err == -EAGAIN && time_before(jiffies, sensor->retry_at))
+		delay = sensor->retry_at - jiffies;
+	else if (release != 0) {
+		wait = ktime_us_delta(release, ktime_get());
+		if (wait > 0)
+			delay = usecs_to_jiffies(wait);
+	}
+	if (err < 0 && delay == 0)
+		delay = max(usecs_to_jiffies(sensor->ping_gap), 1UL);
+		/* don't spin on a sensor that keeps failing */
+
+	spin_lock(&sensor->lock);
+	if (!sensor->removed && !READ_ONCE(sensor->suspended) &&
+	    sensor->streamers > 0)
+		queue_delayed_work(system_long_wq, &sensor->serial_stream,
+				   delay);
+	spin_unlock(&sensor->lock);
+}
+
+/* External triggers: a GPIO edge IRQ fires the trigger pulse of every
+ * sensor on that line right away, the echo is then waited for in
+ * ext_work and queued for the streaming readers. Sensors that are still
+ * busy, inside their ping gap or quarantined skip the edge. ext_lines
+ * and the lines' sensor lists are protected by ext_mutex, taken after
+ * measurement_mutex. A line is freed when nr_sensors drops to 0.
+ *
+ * While a sensor is on a line, only ext_trigger_irq() pings it (do_ping()
+ * returns -EBUSY), so time_burst is only written by the IRQ itself. The
+ * health and retry_at written by ext_work are published by the release
+ * of ext_busy, which the IRQ reads with acquire before looking at them.
+ */
+
+static LIST_HEAD(ext_lines);
+static DEFINE_MUTEX(ext_mutex);
+
+static irqreturn_t ext_trigger_irq(int irq, void *data)
+{
+	struct hc_sr04_ext_line *line = data;
+	struct hc_sr04 *sensor;
+	ktime_t now;
+
+	now = ktime_get();
+	list_for_each_entry(sensor, &line->sensors, ext_list) {
+		if (smp_load_acquire(&sensor->ext_busy) ||
+		    READ_ONCE(sensor->suspended) ||
+		    __gpio_get_value(sensor->gpio_echo) != 0 ||
+		    (sensor->time_burst != 0 &&
+		     usecs_between(sensor->time_burst, now) <
+				sensor->ping_gap) ||
+		    (sensor->health == HEALTH_FAILED &&
+		     time_before(jiffies, sensor->retry_at))) {
+			sensor->ext_missed++;
+			continue;
+		}
+		WRITE_ONCE(sensor->ext_busy, 1);
+		trigger_sensor(sensor);
+		schedule_work(&sensor->ext_work);
+	}
+
+	return IRQ_HANDLED;
+}
+
+static void ext_work_fn(struct work_struct *work)
+{
+	struct hc_sr04 *sensor = container_of(work, struct hc_sr04, ext_work);
+	struct hc_sr04_sample sample;
+	int err;
+
+	mutex_lock(&sensor->measurement_mutex);
+	err = finish_ping(sensor, &sample);
+	mutex_unlock(&sensor->measurement_mutex);
+	queue_stream_record(sensor, err, &sample);
+	smp_store_release(&sensor->ext_busy, 0);
+}
+
+/* measurement_mutex must be held. */
+static int enable_ext_trigger(struct hc_sr04 *sensor, int gpio)
+{
+	struct hc_sr04_ext_line *line;
+	int err;
+
+	mutex_lock(&ext_mutex);
+	list_for_each_entry(line, &ext_lines, list)
+		if (line->gpio == gpio)
+			goto found;
+
+	line = kzalloc(sizeof(*line), GFP_KERNEL);
+	if (line == NULL) {
+		mutex_unlock(&ext_mutex);
+		return -ENOMEM;
+	}
+	line->gpio = gpio;
+	INIT_LIST_HEAD(&line->sensors);
+
+	err = gpio_request(gpio, "hc-sr04 external trigger");
+	if (err < 0)
+		goto out_free;
+	err = gpio_direction_input(gpio);
+	if (err < 0)
+		goto out_gpio;
+	line->irq = gpio_to_irq(gpio);
+	if (line->irq < 0) {
+		err = line->irq;
+		goto out_gpio;
+	}
+	err = request_irq(line->irq, ext_trigger_irq, IRQF_TRIGGER_RISING,
+			  "hc_sr04_ext", line);
+	if (err < 0)
+		goto out_gpio;
+	list_add_tail(&line->list, &ext_lines);
+
+found:
+	err = pm_runtime_get_sync(sensor->dev);
+	if (err < 0) {
+		pm_runtime_put_noidle(sensor->dev);
+		if (line->nr_sensors == 0) {
+			free_irq(line->irq, line);
+			gpio_free(line->gpio);
+			list_del(&line->list);
+			kfree(line);
+		}
+		mutex_unlock(&ext_mutex);
+		return err;
+	}
+		/* the echo IRQ must be on when the edge comes */
+
+	hold_cpu_latency(sensor);
+	disable_irq(line->irq);
+	list_add_tail(&sensor->ext_list, &line->sensors);
+	line->nr_sensors++;
+	sensor->ext_line = line;
+	enable_irq(line->irq);
+	mutex_unlock(&ext_mutex);
+	return 0;
+
+out_gpio:
+	gpio_free(gpio);
+out_free:
+	kfree(line);
+	mutex_unlock(&ext_mutex);
+	return err;
+}
+
+/* measurement_mutex must be held, it is dropped while waiting for the
+ * last external ping.
+ */
+static void disable_ext_trigger(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_ext_line *line = sensor->ext_line;
+
+	if (line == NULL)
+		return;
+
+	mutex_lock(&ext_mutex);
+	disable_irq(line->irq);
+	list_del(&sensor->ext_list);
+	enable_irq(line->irq);
+	mutex_unlock(&ext_mutex);
+	mutex_unlock(&sensor->measurement_mutex);
+	flush_work(&sensor->ext_work);
+		/* ext_work takes measurement_mutex. Nobody else pings
+		 * meanwhile, do_ping() still sees ext_line.
+		 */
+	mutex_lock(&sensor->measurement_mutex);
+	sensor->ext_line = NULL;
+	release_cpu_latency(sensor);
+	pm_runtime_put_autosuspend(sensor->dev);
+
+	mutex_lock(&ext_mutex);
+	if (--line->nr_sensors == 0) {
+		free_irq(line->irq, line);
+		gpio_free(line->gpio);
+		list_del(&line->list);
+		kfree(line);
+	}
+	mutex_unlock(&ext_mutex);
+}
+
+static int sched_thread_fn(void *data)
+{
+	struct hc_sr04 *sensor;
+	ktime_t now, next;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		try_to_freeze();
+		WRITE_ONCE(sched_kicked, 0);
+		now = ktime_get();
+
+		mutex_lock(&devices_mutex);
+		sensor = pick_next_sensor(now, &next);
+		if (sensor != NULL && claim_sensor(sensor) < 0) {
+			sensor = NULL;
+			next = ktime_add_us(now, SCHED_RETRY_USECS);
+				/* busy with an on-demand ping */
+		}
+		mutex_unlock(&devices_mutex);
+
+		if (sensor != NULL) {
+			scheduled_ping(sensor);
+			mutex_unlock(&sensor->measurement_mutex);
+			continue;
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (!READ_ONCE(sched_kicked) && !kthread_should_stop()) {
+			if (next == KTIME_MAX)
+				schedule();
+			else
+				schedule_hrtimeout_range(&next, 100 * NSEC_PER_USEC,
+							 HRTIMER_MODE_ABS);
+		}
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
+
+/* Work is only scheduled under sensor->lock with the sensor not removed,
+ * so remove_sensor() can cancel it for good.
+ */
+static int arm_ping(struct hc_sr04_reader *reader, u32 *seq)
+{
+	struct hc_sr04 *sensor = reader->sensor;
+	int err;
+
+	err = 0;
+	spin_lock(&sensor->lock);
+	if (sensor->removed)
+		err = -ENODEV;
+	else if (reader->arm_seq - reader->done_seq +
+		 kfifo_len(&reader->results) >= READER_FIFO_SIZE)
+		err = -EBUSY;
+	else {
+		*seq = ++reader->arm_seq;
+		fq_kick(sensor);
+	}
+	spin_unlock(&sensor->lock);
+
+	return err;
+}
+
+static int set_streaming(struct hc_sr04_reader *reader, int on)
+{
+	struct hc_sr04 *sensor = reader->sensor;
+	int err;
+
+	err = 0;
+	spin_lock(&sensor->lock);
+	if (sensor->removed) {
+		err = -ENODEV;
+	} else if (on && !reader->streaming) {
+		reader->streaming = 1;
+		if (sensor->streamers++ == 0) {
+			sensor->release = ktime_get();
+			sensor->deadline = sensor->release;
+		}
+		if (sensor->serdev != NULL)
+			mod_delayed_work(system_long_wq, &sensor->serial_stream,
+					 0);
+		else
+			kick_scheduler();
+	} else if (!on && reader->streaming) {
+		reader->streaming = 0;
+		sensor->streamers--;
+	}
+	spin_unlock(&sensor->lock);
+
+	return err;
+}
+
+static int set_watermark(struct hc_sr04_reader *reader,
+			 const struct hc_sr04_watermark *wm)
+{
+	struct hc_sr04 *sensor = reader->sensor;
+
+	if (wm->samples < 1 || wm->samples > READER_FIFO_SIZE)
+		return -EINVAL;
+
+	spin_lock(&sensor->lock);
+	reader->wm_samples = wm->samples;
+	reader->wm_usecs = wm->usecs;
+	spin_unlock(&sensor->lock);
+	wake_up_interruptible(&reader->wait);
+
+	return 0;
+}
+
+static int hc_sr04_open(struct inode *inode, struct file *file)
+{
+	struct hc_sr04_reader *reader;
+	struct hc_sr04 *sensor;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (reader == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&devices_mutex);
+	sensor = idr_find(&hc_sr04_minors, iminor(inode));
+	if (sensor == NULL) {
+		mutex_unlock(&devices_mutex);
+		kfree(reader);
+		return -ENODEV;
+	}
+
+	reader->sensor = sensor;
+	kref_get(&sensor->ref);
+	kref_init(&reader->ref);
+	INIT_KFIFO(reader->results);
+	init_waitqueue_head(&reader->wait);
+	reader->wm_samples = 1;
+	hrtimer_init(&reader->age_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	reader->age_timer.function = reader_aged;
+	reader->client.reader = reader;
+	reader->client.uid = current_uid();
+
+	spin_lock(&sensor->lock);
+	list_add_tail(&reader->list, &sensor->readers);
+	list_add_tail(&reader->client.list, &sensor->clients);
+	spin_unlock(&sensor->lock);
+	mutex_unlock(&devices_mutex);
+
+	file->private_data = reader;
+	return nonseekable_open(inode, file);
+}
+
+static int hc_sr04_release(struct inode *inode, struct file *file)
+{
+	struct hc_sr04_reader *reader = file->private_data;
+	struct hc_sr04 *sensor = reader->sensor;
+
+	spin_lock(&sensor->lock);
+	list_del(&reader->list);
+	list_del(&reader->client.list);
+	if (reader->streaming)
+		sensor->streamers--;
+	spin_unlock(&sensor->lock);
+
+	kref_put(&reader->ref, free_reader);
+	return 0;
+}
+
+static ssize_t hc_sr04_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct hc_sr04_reader *reader = file->private_data;
+	struct hc_sr04 *sensor = reader->sensor;
+	struct hc_sr04_record record;
+	size_t copied;
+	int idle, got;
+	u32 seq;
+	int err;
+
+	if (count < sizeof(record))
+		return -EINVAL;
+
+	spin_lock(&sensor->lock);
+	idle = kfifo_is_empty(&reader->results) && !reader->streaming &&
+	       reader->arm_seq == reader->done_seq;
+	spin_unlock(&sensor->lock);
+
+	if (idle) {
+		err = arm_ping(reader, &seq);
+		if (err < 0)
+			return err;
+	}
+
+	if (file->f_flags & O_NONBLOCK) {
+		if (kfifo_is_empty(&reader->results))
+			return -EAGAIN;
+	} else {
+		err = wait_event_interruptible(reader->wait,
+					       reader_ready(reader));
+		if (err < 0)
+			return err;
+	}
+
+	copied = 0;
+	while (copied + sizeof(record) <= count) {
+		spin_lock(&sensor->lock);
+		got = kfifo_get(&reader->results, &record);
+		if (kfifo_is_empty(&reader->results)) {
+			reader->aged = 0;
+			hrtimer_try_to_cancel(&reader->age_timer);
+		}
+		spin_unlock(&sensor->lock);
+		if (!got)
+			break;
+
+		if (copy_to_user(buf + copied, &record, sizeof(record)))
+			return -EFAULT;
+		copied += sizeof(record);
+	}
+	if (copied == 0)
+		return -ENODEV;
+
+	return copied;
+}
+
+static __poll_t hc_sr04_poll(struct file *file, poll_table *wait)
+{
+	struct hc_sr04_reader *reader = file->private_data;
+	__poll_t mask;
+
+	poll_wait(file, &reader->wait, wait);
+
+	mask = 0;
+	if (reader_ready(reader) && !kfifo_is_empty(&reader->results))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (READ_ONCE(reader->sensor->removed))
+		mask |= EPOLLHUP;
+
+	return mask;
+}
+
+static long hc_sr04_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct hc_sr04_reader *reader = file->private_data;
+	struct hc_sr04_watermark wm;
+	u32 seq, on;
+	int err;
+
+	switch (cmd) {
+	case HC_SR04_IOC_ARM:
+		err = arm_ping(reader, &seq);
+		if (err < 0)
+			return err;
+		return put_user(seq, (__u32 __user *) arg);
+
+	case HC_SR04_IOC_STREAM:
+		if (get_user(on, (__u32 __user *) arg))
+			return -EFAULT;
+		return set_streaming(reader, on != 0);
+
+	case HC_SR04_IOC_SET_WATERMARK:
+		if (copy_from_user(&wm, (void __user *) arg, sizeof(wm)))
+			return -EFAULT;
+		return set_watermark(reader, &wm);
+	}
+	return -ENOTTY;
+}
+
+static const struct file_operations hc_sr04_fops = {
+	.owner = THIS_MODULE,
+	.open = hc_sr04_open,
+	.release = hc_sr04_release,
+	.read = hc_sr04_read,
+	.poll = hc_sr04_poll,
+	.unlocked_ioctl = hc_sr04_ioctl,
+	.llseek = no_llseek,
+};
+
+static ssize_t configure_store(struct class *class,
+				struct class_attribute *attr,
+				const char *buf, size_t len);
+
+static CLASS_ATTR_WO(configure);
+
+static struct attribute *hc_sr04_class_attrs[] = {
+	&class_attr_configure.attr,
+	NULL,
 };
 
 ATTRIBUTE_GROUPS(hc_sr04_class);
 
+/* Power management. Sensors are runtime suspended while idle: echo
+ * edges ignored and, with a power GPIO, the sensor switched off. Pings
+ * resume them. On system sleep pings in flight are dropped with EAGAIN.
+ * Group devices have nothing to do.
+ */
+
+static struct hc_sr04 *dev_to_sensor(struct device *dev)
+{
+	enum hc_sr04_kind *kind = dev_get_drvdata(dev);
+
+	if (kind == NULL || *kind != KIND_SENSOR)
+		return NULL;
+	return container_of(kind, struct hc_sr04, kind);
+}
+
+static int hc_sr04_runtime_suspend(struct device *dev)
+{
+	struct hc_sr04 *sensor = dev_to_sensor(dev);
+
+	if (sensor == NULL || sensor->serdev != NULL)
+		return 0;
+
+	WRITE_ONCE(sensor->rpm_suspended, 1);
+	synchronize_irq(sensor->irq);
+	if (sensor->gpio_power >= 0)
+		gpio_set_value(sensor->gpio_power, 0);
+	return 0;
+}
+
+static int hc_sr04_runtime_resume(struct device *dev)
+{
+	struct hc_sr04 *sensor = dev_to_sensor(dev);
+
+	if (sensor == NULL || sensor->serdev != NULL)
+		return 0;
+
+	if (sensor->gpio_power >= 0) {
+		gpio_set_value(sensor->gpio_power, 1);
+		msleep(POWER_ON_MSECS);
+	}
+	WRITE_ONCE(sensor->rpm_suspended, 0);
+	return 0;
+}
+
+static int hc_sr04_suspend(struct device *dev)
+{
+	struct hc_sr04 *sensor = dev_to_sensor(dev);
+
+	if (sensor == NULL)
+		return 0;
+
+	WRITE_ONCE(sensor->suspended, 1);
+	wake_up_interruptible(&sensor->wait_for_echo);
+	if (sensor->serdev != NULL)
+		complete(&sensor->rx_done);
+	cancel_delayed_work_sync(&sensor->serial_stream);
+		/* requeued by hc_sr04_resume() */
+	mutex_lock(&sensor->measurement_mutex);
+		/* wait until the ping in flight has given up */
+	mutex_unlock(&sensor->measurement_mutex);
+	flush_work(&sensor->ext_work);
+
+	return pm_runtime_force_suspend(dev);
+}
+
+static int hc_sr04_resume(struct device *dev)
+{
+	struct hc_sr04 *sensor = dev_to_sensor(dev);
+	int err;
+
+	if (sensor == NULL)
+		return 0;
+
+	err = pm_runtime_force_resume(dev);
+	sensor->time_burst = 0;
+	WRITE_ONCE(sensor->suspended, 0);
+	spin_lock(&sensor->lock);
+	if (sensor->serdev != NULL && !sensor->removed &&
+	    sensor->streamers > 0)
+		queue_delayed_work(system_long_wq, &sensor->serial_stream, 0);
+	spin_unlock(&sensor->lock);
+	kick_scheduler();
+
+	return err;
+}
+
+static const struct dev_pm_ops hc_sr04_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(hc_sr04_suspend, hc_sr04_resume)
+	SET_RUNTIME_PM_OPS(hc_sr04_runtime_suspend, hc_sr04_runtime_resume,
+			   NULL)
+};
+
 static struct class hc_sr04_class = {
 	.name = "distance-sensor",
 	.owner = THIS_MODULE,
 	.class_groups   = hc_sr04_class_groups,
+	.pm = &hc_sr04_pm_ops,
+};
+
+/* Sensor groups. Each group is a device group_<name> in the class with
+ * the files nearest and members. Groups come and go with their members,
+ * under membership_mutex.
+ */
+
+static LIST_HEAD(hc_sr04_groups);
+
+static ssize_t nearest_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04_group *group = dev_get_drvdata(dev);
+	int len;
+
+	mutex_lock(&groups_mutex);
+	if (group->nearest == NULL)
+		len = sprintf(buf, "none\n");
+	else
+		len = sprintf(buf, "%lld %s %lld\n", group->nearest_usecs,
+			      dev_name(group->nearest->dev),
+			      timespec64_to_ns(&group->nearest_time));
+	mutex_unlock(&groups_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(nearest);
+
+static ssize_t members_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct hc_sr04_group *group = dev_get_drvdata(dev);
+	struct hc_sr04 *sensor;
+	int len;
+
+	len = 0;
+	mutex_lock(&groups_mutex);
+	list_for_each_entry(sensor, &group->members, group_list)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s\n",
+				 dev_name(sensor->dev));
+	mutex_unlock(&groups_mutex);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(members);
+
+static struct attribute *group_attrs[] = {
+	&dev_attr_nearest.attr,
+	&dev_attr_members.attr,
+	NULL,
 };
 
+ATTRIBUTE_GROUPS(group);
+
+/* groups_mutex must be held. */
+static void find_nearest(struct hc_sr04_group *group)
+{
+	struct hc_sr04 *sensor;
+
+	group->nearest = NULL;
+	list_for_each_entry(sensor, &group->members, group_list) {
+		if (!sensor->group_valid)
+			continue;
+		if (group->nearest == NULL ||
+		    sensor->group_usecs < group->nearest_usecs) {
+			group->nearest = sensor;
+			group->nearest_usecs = sensor->group_usecs;
+			group->nearest_time = sensor->group_time;
+		}
+	}
+}
+
+/* groups_mutex must be held. Only a member that was the nearest and got
+ * further away (or lost its echo) makes us look at all members.
+ */
+static void update_nearest(struct hc_sr04_group *group,
+			   struct hc_sr04 *sensor)
+{
+	struct hc_sr04 *old = group->nearest;
+	long long old_usecs = group->nearest_usecs;
+
+	if (sensor->group_valid && (group->nearest == NULL ||
+				    sensor->group_usecs <= group->nearest_usecs)) {
+		group->nearest = sensor;
+		group->nearest_usecs = sensor->group_usecs;
+		group->nearest_time = sensor->group_time;
+	} else if (group->nearest == sensor) {
+		find_nearest(group);
+	}
+
+	if (group->nearest != old ||
+	    (old != NULL && group->nearest_usecs != old_usecs))
+		sysfs_notify(&group->dev->kobj, NULL, "nearest");
+}
+
+/* Timeouts and out of range samples mean nothing in range, flagged
+ * samples are ignored.
+ */
+static void update_group(struct hc_sr04 *device, int err,
+			 const struct hc_sr04_sample *sample)
+{
+	if (err != 0 && err != -ETIMEDOUT && err != -ERANGE)
+		return;
+	if (err == 0 && sample->flags != 0)
+		return;
+
+	mutex_lock(&groups_mutex);
+	if (device->group != NULL) {
+		device->group_valid = err == 0;
+		if (err == 0) {
+			device->group_usecs = sample->usecs;
+			device->group_time = sample->timestamp;
+		}
+		update_nearest(device->group, device);
+	}
+	mutex_unlock(&groups_mutex);
+}
+
+/* membership_mutex must be held. */
+static int join_group(struct hc_sr04 *sensor, const char *name)
+{
+	struct hc_sr04_group *group;
+	int new;
+
+	new = 0;
+	list_for_each_entry(group, &hc_sr04_groups, list)
+		if (strcmp(group->name, name) == 0)
+			goto found;
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (group == NULL)
+		return -ENOMEM;
+	group->kind = KIND_GROUP;
+	strscpy(group->name, name, sizeof(group->name));
+	INIT_LIST_HEAD(&group->members);
+	group->dev = device_create_with_groups(&hc_sr04_class, NULL, 0,
+			group, group_groups, "group_%s", name);
+	if (IS_ERR(group->dev)) {
+		int err = PTR_ERR(group->dev);
+
+		kfree(group);
+		return err;
+	}
+	list_add_tail(&group->list, &hc_sr04_groups);
+	new = 1;
+
+found:
+	mutex_lock(&groups_mutex);
+	sensor->group_valid = 0;
+	list_add_tail(&sensor->group_list, &group->members);
+	sensor->group = group;
+	mutex_unlock(&groups_mutex);
+
+	if (new)
+		pr_info("hc-sr04: added group %s\n", name);
+	return 0;
+}
+
+/* membership_mutex must be held. */
+static void leave_group(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_group *group = sensor->group;
+	int empty;
+
+	if (group == NULL)
+		return;
+
+	mutex_lock(&groups_mutex);
+	list_del(&sensor->group_list);
+	sensor->group = NULL;
+	empty = list_empty(&group->members);
+	if (!empty && group->nearest == sensor) {
+		find_nearest(group);
+		sysfs_notify(&group->dev->kobj, NULL, "nearest");
+	}
+	mutex_unlock(&groups_mutex);
+
+	if (empty) {
+		list_del(&group->list);
+		device_unregister(group->dev);
+		pr_info("hc-sr04: removed group %s\n", group->name);
+		kfree(group);
+	}
+}
 
 static struct hc_sr04 *find_sensor(int trig, int echo)
 {
 	struct hc_sr04 *sensor;
 
 	list_for_each_entry(sensor, &hc_sr04_devices, list) {
-		if (sensor->gpio_trig == trig &&
+		if (sensor->serdev == NULL &&
+		    sensor->gpio_trig == trig &&
 		    sensor->gpio_echo == echo)
 			return sensor;
 	}
@@ -303,35 +4216,166 @@ static int match_device(struct device *dev, const void *data)
 	return dev_get_drvdata(dev) == data;
 }
 
-static int add_sensor(int trig, int echo, unsigned long timeout)
+/* Called with devices_mutex held. */
+static int consumers_add(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_consumer *consumer;
+	int err = 0;
+
+	down_read(&consumers_rwsem);
+	list_for_each_entry(consumer, &hc_sr04_consumers, list) {
+		if (consumer->add == NULL)
+			continue;
+		err = consumer->add(sensor, sensor->dev);
+		if (err < 0) {
+			list_for_each_entry_continue_reverse(consumer,
+					&hc_sr04_consumers, list)
+				if (consumer->remove)
+					consumer->remove(sensor, sensor->dev);
+			break;
+		}
+	}
+	up_read(&consumers_rwsem);
+	return err;
+}
+
+static void consumers_remove(struct hc_sr04 *sensor)
+{
+	struct hc_sr04_consumer *consumer;
+
+	down_read(&consumers_rwsem);
+	list_for_each_entry_reverse(consumer, &hc_sr04_consumers, list)
+		if (consumer->remove)
+			consumer->remove(sensor, sensor->dev);
+	up_read(&consumers_rwsem);
+}
+
+int hc_sr04_register_consumer(struct hc_sr04_consumer *consumer)
+{
+	struct hc_sr04 *sensor;
+	int err;
+
+	mutex_lock(&devices_mutex);
+	list_for_each_entry(sensor, &hc_sr04_devices, list) {
+		if (consumer->add == NULL)
+			break;
+		err = consumer->add(sensor, sensor->dev);
+		if (err < 0) {
+			list_for_each_entry_continue_reverse(sensor,
+					&hc_sr04_devices, list)
+				if (consumer->remove)
+					consumer->remove(sensor, sensor->dev);
+			mutex_unlock(&devices_mutex);
+			return err;
+		}
+	}
+
+	down_write(&consumers_rwsem);
+	list_add_tail(&consumer->list, &hc_sr04_consumers);
+	up_write(&consumers_rwsem);
+	mutex_unlock(&devices_mutex);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(hc_sr04_register_consumer);
+
+/* remove() drains the consumer's sysfs readers. That is fine with
+ * devices_mutex held since hc_sr04_measure() does not take it, and
+ * holding it keeps remove_sensor() from unregistering a device under us.
+ */
+void hc_sr04_unregister_consumer(struct hc_sr04_consumer *consumer)
+{
+	struct hc_sr04 *sensor;
+
+	mutex_lock(&devices_mutex);
+	down_write(&consumers_rwsem);
+	list_del(&consumer->list);
+	up_write(&consumers_rwsem);
+
+	if (consumer->remove)
+		list_for_each_entry(sensor, &hc_sr04_devices, list)
+			consumer->remove(sensor, sensor->dev);
+	mutex_unlock(&devices_mutex);
+}
+EXPORT_SYMBOL_GPL(hc_sr04_unregister_consumer);
+
+static int register_sensor(struct hc_sr04 *new_sensor, const char *name)
+{
+	int err;
+
+	new_sensor->dev = device_create_with_groups(&hc_sr04_class, NULL,
+			MKDEV(MAJOR(hc_sr04_devt), new_sensor->minor),
+			new_sensor, sensor_groups, "%s", name);
+	if (IS_ERR(new_sensor->dev)) {
+		err = PTR_ERR(new_sensor->dev);
+
+		destroy_hc_sr04(new_sensor);
+		return err;
+	}
+
+	err = consumers_add(new_sensor);
+	if (err < 0) {
+		device_unregister(new_sensor->dev);
+		destroy_hc_sr04(new_sensor);
+		return err;
+	}
+
+	pm_runtime_set_autosuspend_delay(new_sensor->dev, AUTOSUSPEND_MSECS);
+	pm_runtime_use_autosuspend(new_sensor->dev);
+	pm_runtime_enable(new_sensor->dev);
+	return 0;
+}
+
+static int add_sensor(int trig, int echo, unsigned long timeout, int power)
 {
 	struct hc_sr04 *new_sensor;
+	char name[32];
 
-	new_sensor = create_hc_sr04(trig, echo, timeout);
+	new_sensor = create_hc_sr04(trig, echo, timeout, power);
 	if (IS_ERR(new_sensor)) {
 		return PTR_ERR(new_sensor);
 	}
 
-	device_create_with_groups(&hc_sr04_class, NULL, MKDEV(0, 0), new_sensor,
-			sensor_groups, "distance_%d_%d", trig, echo);
-	return 0;
+	snprintf(name, sizeof(name), "distance_%d_%d", trig, echo);
+	return register_sensor(new_sensor, name);
 }
 
 static int remove_sensor(struct hc_sr04 *rip_sensor)
 	/* must be called with devices_mutex held. */
 {
+	struct hc_sr04_reader *reader;
 	struct device *dev;
+	int i;
 
 	dev = class_find_device(&hc_sr04_class, NULL, rip_sensor, match_device);
 	if (dev == NULL)
 		return -ENODEV;
 
+	spin_lock(&rip_sensor->lock);
+	rip_sensor->removed = 1;
+	list_for_each_entry(reader, &rip_sensor->readers, list)
+		wake_up_interruptible(&reader->wait);
+	for (i = 0; i < rip_sensor->nr_uid_clients; i++)
+		wake_up_all(&rip_sensor->uid_clients[i].wait);
+	spin_unlock(&rip_sensor->lock);
+	cancel_delayed_work_sync(&rip_sensor->ping_work);
+	cancel_delayed_work_sync(&rip_sensor->serial_stream);
+
 	mutex_lock(&rip_sensor->measurement_mutex);
 			/* wait until measurement has finished */
+	disable_ext_trigger(rip_sensor);
+	mutex_lock(&membership_mutex);
+	leave_group(rip_sensor);
+	mutex_unlock(&membership_mutex);
+	mutex_unlock(&rip_sensor->measurement_mutex);
+		/* sysfs readers still waiting for it see removed and
+		 * return, so the files below can be drained.
+		 */
+
+	consumers_remove(rip_sensor);
+	pm_runtime_disable(dev);
 
 	device_unregister(dev);
 	put_device(dev);
-	mutex_unlock(&rip_sensor->measurement_mutex);
 
 	destroy_hc_sr04(rip_sensor);
 	return 0;
@@ -343,7 +4387,7 @@ static ssize_t configure_store(struct class *class,
 {
 	int add = buf[0] != '-';
 	const char *s = buf;
-	int trig, echo, timeout;
+	int trig, echo, timeout, power;
 	struct hc_sr04 *rip_sensor;
 	int err;
 
@@ -351,7 +4395,8 @@ static ssize_t configure_store(struct class *class,
 		s++;
 
 	if (add) {
-		if (sscanf(s, "%d %d %d", &trig, &echo, &timeout) != 3)
+		power = -1;
+		if (sscanf(s, "%d %d %d %d", &trig, &echo, &timeout, &power) < 3)
 			return -EINVAL;
 
 		mutex_lock(&devices_mutex);
@@ -360,7 +4405,7 @@ static ssize_t configure_store(struct class *class,
 			return -EEXIST;
 		}
 
-		err = add_sensor(trig, echo, timeout);
+		err = add_sensor(trig, echo, timeout, power);
 		mutex_unlock(&devices_mutex);
 		if (err < 0)
 			return err;
@@ -385,15 +4430,119 @@ static ssize_t configure_store(struct class *class,
 	return len;
 }
 
+/* Serial sensors are found via device tree, e.g.
+ *
+ *	&uart3 {
+ *		distance-sensor {
+ *			compatible = "jsn,jsn-sr04t";
+ *		};
+ *	};
+ *
+ * (or "softerra,us-100") and show up as distance_<serdev name>. See
+ * Documentation/devicetree/bindings/hc-sr04-serial.yaml.
+ */
+
+static int hc_sr04_serdev_probe(struct serdev_device *serdev)
+{
+	struct hc_sr04 *new_sensor;
+	char name[32];
+	int err;
+
+	serdev_device_set_client_ops(serdev, &serial_ops);
+
+	mutex_lock(&devices_mutex);
+	new_sensor = create_serial_hc_sr04(serdev,
+		(enum hc_sr04_serial_proto)
+			(uintptr_t) of_device_get_match_data(&serdev->dev));
+	if (IS_ERR(new_sensor)) {
+		mutex_unlock(&devices_mutex);
+		return PTR_ERR(new_sensor);
+	}
+	snprintf(name, sizeof(name), "distance_%s", dev_name(&serdev->dev));
+	err = register_sensor(new_sensor, name);
+	mutex_unlock(&devices_mutex);
+	if (err < 0)
+		return err;
+
+	pr_info("hc-sr04: added serial device %s\n", dev_name(&serdev->dev));
+	return 0;
+}
+
+static void hc_sr04_serdev_remove(struct serdev_device *serdev)
+{
+	struct hc_sr04 *rip_sensor = serdev_device_get_drvdata(serdev);
+
+	mutex_lock(&devices_mutex);
+	remove_sensor(rip_sensor);
+	mutex_unlock(&devices_mutex);
+	pr_info("hc-sr04: removed serial device %s\n",
+		dev_name(&serdev->dev));
+}
+
+static const struct of_device_id hc_sr04_of_match[] = {
+	{ .compatible = "jsn,jsn-sr04t", .data = (void *) SERIAL_JSN_SR04T },
+	{ .compatible = "softerra,us-100", .data = (void *) SERIAL_US100 },
+	{ }
+};
+MODULE_DEVICE_TABLE(of, hc_sr04_of_match);
+
+static struct serdev_device_driver hc_sr04_serdev_driver = {
+	.probe = hc_sr04_serdev_probe,
+	.remove = hc_sr04_serdev_remove,
+	.driver = {
+		.name = "hc-sr04-serial",
+		.of_match_table = of_match_ptr(hc_sr04_of_match),
+	},
+};
+
 static int __init init_hc_sr04(void)
 {
-	return class_register(&hc_sr04_class);
+	int err;
+
+	sched_task = kthread_run(sched_thread_fn, NULL, "hc-sr04-sched");
+	if (IS_ERR(sched_task))
+		return PTR_ERR(sched_task);
+	sched_set_fifo(sched_task);
+
+	err = alloc_chrdev_region(&hc_sr04_devt, 0, HC_SR04_MAX_MINORS,
+				  "hc-sr04");
+	if (err < 0)
+		goto out_sched;
+
+	cdev_init(&hc_sr04_cdev, &hc_sr04_fops);
+	hc_sr04_cdev.owner = THIS_MODULE;
+	err = cdev_add(&hc_sr04_cdev, hc_sr04_devt, HC_SR04_MAX_MINORS);
+	if (err < 0)
+		goto out_region;
+
+	err = class_register(&hc_sr04_class);
+	if (err < 0)
+		goto out_cdev;
+
+	err = serdev_device_driver_register(&hc_sr04_serdev_driver);
+	if (err < 0)
+		goto out_class;
+
+	return 0;
+
+out_class:
+	class_unregister(&hc_sr04_class);
+out_cdev:
+	cdev_del(&hc_sr04_cdev);
+out_region:
+	unregister_chrdev_region(hc_sr04_devt, HC_SR04_MAX_MINORS);
+out_sched:
+	kthread_stop(sched_task);
+	return err;
 }
 
 static void exit_hc_sr04(void)
 {
 	struct hc_sr04 *rip_sensor, *tmp;
 
+	serdev_device_driver_unregister(&hc_sr04_serdev_driver);
+	kthread_stop(sched_task);
+
 	mutex_lock(&devices_mutex);
 	list_for_each_entry_safe(rip_sensor, tmp, &hc_sr04_devices, list) {
 		remove_sensor(rip_sensor);   /* ignore errors */
@@ -401,6 +4550,9 @@ static void exit_hc_sr04(void)
 	mutex_unlock(&devices_mutex);
 
 	class_unregister(&hc_sr04_class);
+	cdev_del(&hc_sr04_cdev);
+	unregister_chrdev_region(hc_sr04_devt, HC_SR04_MAX_MINORS);
+	idr_destroy(&hc_sr04_minors);
 }
 
 module_init(init_hc_sr04);
@@ -0,0 +1,128 @@
+/* Interface of the /dev/distance_<trig>_<echo> character devices of the
+ * HC-SR04 driver. Shared between the driver and userspace.
+ *
+ * HC_SR04_IOC_ARM starts a ping and returns at once, the __u32 argument
+ * receives its sequence number. read() returns one struct hc_sr04_record
+ * per finished ping in the order they were armed on this file, poll()
+ * reports when one is ready. A read() with nothing armed arms a ping
+ * itself, so a plain read measures.
+ *
+ * HC_SR04_IOC_STREAM with a non-zero __u32 switches the file to stream
+ * mode: the sensor is pinged continuously while any file streams, and
+ * every result is queued for all streaming files. If a file falls behind,
+ * the oldest results are dropped.
+ *
+ * HC_SR04_IOC_SET_WATERMARK limits wakeups: read() and poll() only report
+ * data once at least samples results are queued, or the oldest of them
+ * was queued usecs ago (0: no age limit). The default is one sample, a
+ * non-blocking read() returns whatever is queued.
+ */
+
+#ifndef _HC_SR04_H
+#define _HC_SR04_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Bits in hc_sr04_record.flags. Flagged samples are still reported,
+ * consumers decide whether to drop them.
+ */
+#define HC_SR04_SAMPLE_CROSSTALK	0x01	/* another sensor fired while
+						 * we waited for the echo */
+#define HC_SR04_SAMPLE_GHOST		0x02	/* echo belongs to the previous
+						 * ping of this sensor */
+#define HC_SR04_SAMPLE_EDGES_LOST	0x04	/* more than HC_SR04_MAX_EDGES
+						 * edges in multi-edge mode */
+#define HC_SR04_SAMPLE_OUT_OF_RANGE	0x08	/* outside the region of
+						 * interest, status is
+						 * -ERANGE */
+#define HC_SR04_SAMPLE_STREAM		0x10	/* stream record, seq counts
+						 * the sensor's stream and
+						 * not this file's pings */
+
+/* Edges captured in multi-edge mode: usecs after the trigger, with
+ * HC_SR04_EDGE_RISING set for rising edges.
+ */
+#define HC_SR04_MAX_EDGES		16
+#define HC_SR04_EDGE_RISING		0x80000000
+#define HC_SR04_EDGE_USECS		0x7fffffff
+
+struct hc_sr04_record {
+	__u32 seq;
+	__s32 status;		/* 0 or negative errno, e.g. -ETIMEDOUT. The
+				 * fields below are also valid for -ERANGE */
+	__s64 timestamp_ns;	/* rising edge of the echo, in the sensor's
+				 * clock (sysfs), CLOCK_REALTIME by default */
+	__u32 usecs;		/* length of the echo pulse */
+	__u32 flags;
+};
+
+/* Read from the binary rollups sysfs file: aggregates of the echo
+ * lengths (usecs) of successful pings per period, errors count the
+ * timeouts. Out of range (-ERANGE) pings are not counted. start_ns is in
+ * the sensor's clock, 0 for unused buckets.
+ */
+struct hc_sr04_rollup {
+	__s64 start_ns;
+	__u32 period_secs;
+	__u32 count;
+	__u32 errors;
+	__u32 min;
+	__u32 max;
+	__u32 mean;
+};
+
+struct hc_sr04_watermark {
+	__u32 samples;		/* 1 to 64 */
+	__u32 usecs;
+};
+
+/* Generic netlink interface of hc-sr04-netlink.ko: join the multicast
+ * group HC_SR04_NL_GROUP of family HC_SR04_NL_FAMILY to receive one
+ * HC_SR04_NL_CMD_SAMPLE message per finished ping of any sensor.
+ * Timestamp, usecs and flags are only present if status is 0 or
+ * -ERANGE, the edges only in multi-edge mode.
+ *
+ * A HC_SR04_NL_CMD_GET_STATS dump request returns one message per sensor
+ * with its name, the counters and timestamp, usecs and flags of its last
+ * successful ping (if any), without pinging anything.
+ */
+#define HC_SR04_NL_FAMILY	"hc_sr04"
+#define HC_SR04_NL_GROUP	"samples"
+
+enum {
+	HC_SR04_NL_CMD_UNSPEC,
+	HC_SR04_NL_CMD_SAMPLE,
+	HC_SR04_NL_CMD_GET_STATS,
+};
+
+enum {
+	HC_SR04_NL_ATTR_UNSPEC,
+	HC_SR04_NL_ATTR_SENSOR,		/* string, e.g. distance_23_24 */
+	HC_SR04_NL_ATTR_STATUS,		/* __s32, 0 or negative errno */
+	HC_SR04_NL_ATTR_TIMESTAMP,	/* __s64, ns, the sensor's clock */
+	HC_SR04_NL_ATTR_USECS,		/* __u32 */
+	HC_SR04_NL_ATTR_FLAGS,		/* __u32 */
+	HC_SR04_NL_ATTR_PAD,
+	HC_SR04_NL_ATTR_PINGS,		/* __u64, counters from here on */
+	HC_SR04_NL_ATTR_TIMEOUTS,	/* __u64 */
+	HC_SR04_NL_ATTR_GLITCHES,	/* __u64 */
+	HC_SR04_NL_ATTR_STUCK_ECHOES,	/* __u64 */
+	HC_SR04_NL_ATTR_POWER_CYCLES,	/* __u64 */
+	HC_SR04_NL_ATTR_MISSED_DEADLINES, /* __u64 */
+	HC_SR04_NL_ATTR_EXT_MISSED,	/* __u64 */
+	HC_SR04_NL_ATTR_HEALTH,		/* __u32, 0 ok, 1 degraded, 2 failed */
+	HC_SR04_NL_ATTR_CONFIDENCE,	/* __u32, 0 to 100, with usecs */
+	HC_SR04_NL_ATTR_EDGES,		/* __u32 array, multi-edge mode only,
+					 * see HC_SR04_EDGE_RISING */
+	__HC_SR04_NL_ATTR_MAX,
+};
+#define HC_SR04_NL_ATTR_MAX	(__HC_SR04_NL_ATTR_MAX - 1)
+
+#define HC_SR04_IOC_MAGIC	'u'
+#define HC_SR04_IOC_ARM		_IOR(HC_SR04_IOC_MAGIC, 1, __u32)
+#define HC_SR04_IOC_STREAM	_IOW(HC_SR04_IOC_MAGIC, 2, __u32)
+#define HC_SR04_IOC_SET_WATERMARK \
+	_IOW(HC_SR04_IOC_MAGIC, 3, struct hc_sr04_watermark)
+
+#endif
@@ -1,2 +1,3 @@
-insmod distance.ko
+insmod hc-sr04.ko
+insmod hc-sr04-sysfs.ko
 echo "23 24 3000" > /sys/class/distance-sensor/configure